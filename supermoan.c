@@ -1,22 +1,32 @@
-// To compile: gcc -Wall -g -lm -pthread -o supermoan supermoan.c
+// To compile: gcc -Wall -g -o supermoan supermoan.c -lm -pthread
+// With the PipeWire backend, add -DSUPERMOAN_PIPEWIRE and the flags from
+// `pkg-config --cflags --libs libpipewire-0.3`. With the JACK backend, add
+// -DSUPERMOAN_JACK -ljack. With the native ALSA backend, add
+// -DSUPERMOAN_ALSA -lasound.
 // Run with options:
 //   --list-devices (-l): List available input devices
-//   --input (-i) <device>: Specify input device path
+//   --input (-i) <device>: Specify input device path; repeat for several devices
 //   --debug (-d): Enable debug output
 //   --no-sound (-n): Don't play sound files (for testing)
 //   --version (-v): Display version information
 //   --sound-dir (-s): Specify custom folder containing .wav files
+//   --backend (-o) <name>: Audio output backend (aplay, alsa, pipewire, jack, null)
+//   --tee <output>: Also send the mix to wav:FILE, alsa:DEVICE or shm:SOCKET
+//   --events <output>: Write binary intensity records to -, a FIFO, a file or unix:SOCKET
+//   --idle-timeout MS: Quiet period before playback goes idle
+//   --soak SECONDS: Run the leak/drift soak harness instead of normal monitoring
 
 #define SUPERMOAN_VERSION "1.0.0"
 #define SUPERMOAN_COPYRIGHT "Copyright (C) 2025"
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <linux/input.h>
 #include <dirent.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -27,6 +37,37 @@
 #include <pthread.h>
 #include <getopt.h>
 #include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdarg.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SUPERMOAN_X86 1
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef SUPERMOAN_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#ifdef SUPERMOAN_PIPEWIRE
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#endif
+
+#ifdef SUPERMOAN_JACK
+#include <jack/jack.h>
+#endif
 
 #define NUM_INTENSITY_LEVELS 10
 #define DEV_INPUT_PATH "/dev/input"
@@ -38,13 +79,140 @@
 #define DEFAULT_MAX_THRESHOLD 100.0
 #define DEFAULT_LOG_BASE 2.0
 
+#define ENGINE_CHANNELS 2
+#define DEFAULT_SAMPLE_RATE 48000
+#define DEFAULT_PERIOD_FRAMES 256
+#define DEFAULT_BUFFER_FRAMES 1024
+#define MAX_PERIOD_FRAMES 8192
+#define MAX_VOICES 32
+#define VOICE_FRAC_BITS 32
+#define VOICE_UNITY (1ULL << VOICE_FRAC_BITS)
+#define DEFAULT_VOICES 1
+#define TRIGGER_QUEUE_SIZE 64
+#define DEFAULT_IDLE_TIMEOUT_MS 2000
+#define ONSET_PEAK_WINDOW_MS 1000
+#define DEFAULT_HEADROOM_WARN 20.0
+#define DEFAULT_READER_DELAY_BOUND_US 5000
+#define READ_BATCH 64
+#define SERIES_SECONDS 3600
+#define STATS_FILE_MAGIC "SMSTAT1"
+#define LOAD_BUCKET_PERMILLE 5
+#define LOAD_BUCKETS 401
+#define HEADROOM_WINDOW_MS 1000
+#define CALLBACK_POLL_MS 100
+#define TEE_STAGING_FRAMES (4 * MAX_PERIOD_FRAMES)
+#define DEGRADE_MAX_LEVEL 3
+#define DEGRADE_CALM_WINDOWS 5
+#define DEGRADE_QUOTA_HIGH 0.9
+#define DEGRADE_QUOTA_LOW 0.6
+#define DEGRADED_AGGREGATE_MS 20
+#define REPORT_GAP_US 250000
+#define REPORT_MAX_FOLD 16
+#define REPORT_RATE_WEIGHT (1.0 / 64)
+#define REPORT_RATE_SETTLED 32
+#define AUTO_AGGREGATE_REFERENCE_US 8000
+#define PROBE_MAX_DEVICES 64
+#define MAX_INPUT_DEVICES 8
+#define SOURCE_FRAMES 64
+#define FRAME_MAX_EVENTS 16
+#define DEFAULT_REORDER_US 2000
+#define MAX_REORDER_US 50000
+#define MAX_SINKS 4
+#define SINK_BUFFER_MS 2000
+#define SINK_DRAIN_MS 1000
+#define WAV_HEADER_BYTES 44
+#define SHM_RING_MAGIC "SMRING1"
+#define SHM_RING_HEADER 4096
+#define EVENT_STREAM_MAGIC "SMEVNT1"
+#define EVENT_HEADER_BYTES 16
+#define EVENT_RECORD_BYTES 20
+#define EVENT_QUEUE_SIZE 4096
+#define EVENT_BATCH 256
+#define EVENT_DRAIN_MS 1000
+#define DEFAULT_BACKEND "aplay"
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define MAX_LOADER_THREADS 8
+#define TREND_WINDOW_MS 100
+#define PREFETCH_AHEAD 2
+#define FILTER_LANES 8
+#define FILTER_GROUP_VOICES (FILTER_LANES / ENGINE_CHANNELS)
+#define FILTER_MAX_CUTOFF 12000.0
+#define FILTER_OCTAVES_PER_LEVEL 0.5
+#define FILTER_Q 0.8
+#define FILTER_DB_PER_LEVEL 1.5
+#define FILTER_SEMITONES_PER_LEVEL 0.5
+#define PACKED_BANK_NAME "bank.smb"
+#define PACKED_MAGIC "SMBANK1"
+#define PACKED_HEADER_BYTES 12
+#define PACKED_ENTRY_BYTES 32
+#define PACKED_BLOCK_FRAMES 4096
+#define PACKED_PARTITION 256
+#define PACKED_MAX_ORDER 4
+#define PACKED_RICE_ESCAPE 32
+#define SYNTH_FORMANTS 3
+#define SYNTH_BASE_MS 450
+#define SYNTH_MS_PER_LEVEL 50
+#define SYNTH_MIN_F0 165.0
+#define SYNTH_MAX_F0 260.0
+#define SYNTH_ATTACK 0.08
+#define SYNTH_RELEASE 0.4
+#define SYNTH_VIBRATO_HZ 5.5
+#define SYNTH_OUTPUT_GAIN 0.5f
+
+#define RECOVERY_MIN_BACKOFF_MS 100
+#define RECOVERY_MAX_BACKOFF_MS 5000
+#define RECOVERY_STABLE_MS 2000
+
+#define ADAPT_WINDOW_MS 1000
+#define ADAPT_STABLE_WINDOWS 30
+#define ADAPT_MAX_STEP_FAILURES 2
+#define ADAPT_MAX_RENDER_LOAD 0.8
+#define ADAPT_STEP_DOWN_LOAD 0.4
+#define ADAPT_HISTORY 32
+
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_BUCKETS (32 * LATENCY_SUB_BUCKETS)
+
+#define DEFAULT_SOAK_INTERVAL 10.0
+#define DEFAULT_SOAK_RATE 1000.0
+#define DEFAULT_SOAK_MAX_RSS_GROWTH_KB 1024
+#define DEFAULT_SOAK_MAX_FD_GROWTH 0
+#define DEFAULT_SOAK_MAX_THREAD_GROWTH 0
+#define DEFAULT_SOAK_MAX_LATENCY_DRIFT 2.0
+
 static const char *sound_directory = DEFAULT_SOUND_DIR;
 static char sound_path_buffer[PATH_MAX];
 static double min_movement_threshold = DEFAULT_MIN_THRESHOLD;
 static double max_movement_threshold = DEFAULT_MAX_THRESHOLD;
 static double log_base = DEFAULT_LOG_BASE;
 static volatile bool running = true;
+// Written by the SIGINT handler to wake the main thread, whichever thread
+// the signal landed on.
+static int shutdown_fd = -1;
 static bool no_sound = false;
+static const char *backend_name = DEFAULT_BACKEND;
+static const char *audio_device = NULL;
+static int sample_rate = DEFAULT_SAMPLE_RATE;
+static int period_frames = DEFAULT_PERIOD_FRAMES;
+static int buffer_frames = DEFAULT_BUFFER_FRAMES;
+static int max_voices = DEFAULT_VOICES;
+static long idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+static double headroom_warn_pct = DEFAULT_HEADROOM_WARN;
+static long reader_delay_bound_us = DEFAULT_READER_DELAY_BOUND_US;
+static const char *series_path = NULL;
+static const char *stats_path = NULL;
+static long aggregate_ms = 0;
+static bool aggregate_auto = false;
+static long probe_rate_ms = 0;
+static long reorder_us = DEFAULT_REORDER_US;
+static const char *shm_consume_path = NULL;
+static const char *event_path = NULL;
+static bool adaptive_latency = false;
+static bool lock_bank = false;
+static bool lazy_bank = false;
+static const char *huge_pages = "off";
+static const char *filter_render = NULL;
+static bool synth_render = false;
 
 struct debug_stats {
     long intensity_counts[NUM_INTENSITY_LEVELS + 1];
@@ -54,22 +222,496 @@ struct debug_stats {
     bool enabled;
 };
 
-static volatile int current_intensity = 0;
-static volatile bool is_playing = false;
+// Log-linear histogram of microsecond latencies: LATENCY_SUB_BUCKETS
+// buckets per power of two, so percentiles are accurate to ~12%.
+struct latency_histogram {
+    long buckets[LATENCY_BUCKETS];
+    long count;
+    long max_us;
+};
+
+// Streaming estimate of how often a device reports. A device only reports
+// while it moves, so intervals past REPORT_GAP_US are pauses, and an
+// interval spanning a few polls is folded back onto one poll before it
+// enters the weighted mean. Jitter is the deviation of each folded
+// interval from the mean.
+struct report_rate {
+    const char *name;
+    struct timespec last;
+    double interval_us;
+    double jitter_us;
+    long reports;
+    long intervals;
+    struct latency_histogram deviation;
+};
+
+// Render CPU time per period as a share of the period's duration, in
+// LOAD_BUCKET_PERMILLE steps up to 200%; the last bucket collects the rest.
+// Headroom is 100% minus load.
+struct load_histogram {
+    long buckets[LOAD_BUCKETS];
+    long count;
+    long max_permille;
+};
+
+struct soak_config {
+    double duration;
+    double interval;
+    double event_rate;
+    long max_rss_growth_kb;
+    int max_fd_growth;
+    int max_thread_growth;
+    double max_latency_drift;
+};
+
+struct process_sample {
+    long rss_kb;
+    int open_fds;
+    int threads;
+    long context_switches;
+};
+
+// One intensity level of the sound bank, converted at load time to
+// float32 planes at sample_rate: one plane for mono sources, which the
+// mixer pans to both outputs, two for everything else. Each clip lives in
+// its own anonymous mapping so it can be locked and backed by huge pages.
+struct sample_clip {
+    float *planes[ENGINE_CHANNELS];
+    int channels;
+    int rate;
+    size_t length;
+    size_t mapped_bytes;
+    bool locked;
+};
+
+// The voice pool in structure-of-arrays form. The hot arrays are all the
+// mixer touches each period (32 voices fit in a few cache lines); only
+// the slots on the active list are visited, and free slots are kept on a
+// stack so starting a voice does not scan the pool either. Positions and
+// increments are 32.32 fixed point frames. The svf_ arrays hold each
+// voice's lowpass coefficients and state for --filter-render.
+struct voice_pool {
+    const struct sample_clip *clip[MAX_VOICES];
+    uint64_t position[MAX_VOICES];
+    uint64_t increment[MAX_VOICES];
+    float gain[MAX_VOICES];
+    uint32_t offset[MAX_VOICES];
+    float svf_a1[MAX_VOICES];
+    float svf_a2[MAX_VOICES];
+    float svf_a3[MAX_VOICES];
+    float svf_ic1[MAX_VOICES][ENGINE_CHANNELS];
+    float svf_ic2[MAX_VOICES][ENGINE_CHANNELS];
+    uint8_t active[MAX_VOICES];
+    uint8_t free[MAX_VOICES];
+    int active_count;
+    int free_count;
+};
+
+// Cold per-voice metadata, touched only when a voice starts and by the
+// statistics.
+struct voice_info {
+    int level;
+    struct timespec trigger_time;
+    struct timespec start_time;
+    long plays;
+};
+
+// Mixer kernels over float32 planes. gain() writes src * g, mix() adds
+// src * g, pan() adds one source plane to both outputs with their own
+// gains, and to_s16() interleaves and saturates the bus into the output.
+// One set is chosen at startup from the CPU's features.
+struct mix_kernels {
+    const char *name;
+    void (*gain)(float *dst, const float *src, size_t n, float g);
+    void (*mix)(float *dst, const float *src, size_t n, float g);
+    void (*pan)(float *left, float *right, const float *src, size_t n, float gl, float gr);
+    void (*to_s16)(int16_t *out, const float *left, const float *right, size_t n);
+    bool (*supported)(void);
+};
+
+struct trigger {
+    int level;
+    struct timespec time;
+};
+
+// Push backends implement write(), which blocks until the device accepts
+// the period and so paces the render thread. Callback-driven backends
+// leave write() NULL and call engine_render_callback() from their own
+// process callback. pause() is called when the engine goes idle and again
+// when it resumes. xruns(), when the backend can observe them, returns the
+// cumulative underrun count and enables adaptive latency tuning. delay()
+// returns how many frames will be played before the next one written, or
+// -1 if unknown; callback backends without it are assumed one period deep.
+struct output_backend {
+    const char *name;
+    bool (*open)(void);
+    bool (*write)(const int16_t *frames, size_t count);
+    void (*pause)(bool paused);
+    void (*close)(void);
+    long (*xruns)(void);
+    long (*delay)(void);
+};
+
+struct latency_step {
+    int period;
+    int buffer;
+};
+
+struct latency_adjustment {
+    double at;
+    int from;
+    int to;
+    long xruns;
+    double load;
+};
+
+// Walks a ladder of period/buffer sizes: one step up after any window
+// with an xrun or too little render headroom, one step down after
+// ADAPT_STABLE_WINDOWS clean windows, but never back onto a step that
+// has already failed ADAPT_MAX_STEP_FAILURES times.
+struct latency_tuner {
+    int step;
+    int failures[16];
+    long window_frames;
+    long window_start_xruns;
+    long window_max_render_us;
+    int clean_windows;
+    struct latency_adjustment history[ADAPT_HISTORY];
+    int adjustments;
+};
+
+struct engine_stats {
+    atomic_long reader_wakeups;
+    atomic_long render_wakeups;
+    atomic_long render_idle_wakeups;
+    atomic_long idle_entries;
+    atomic_long idle_ns;
+    atomic_long triggers_dropped;
+    atomic_long triggers_dropped_outage;
+    atomic_long triggers_skipped_loading;
+    atomic_long reader_delays_over_bound;
+    atomic_long input_frames;
+    atomic_long input_frames_reordered;
+    atomic_long input_frames_late;
+    atomic_long input_frames_forced;
+    atomic_long input_events;
+    atomic_long frames_rendered;
+    atomic_long xruns;
+    atomic_long level_triggers[NUM_INTENSITY_LEVELS + 1];
+    atomic_long device_errors;
+    atomic_long reopen_attempts;
+    atomic_long outage_ns;
+    atomic_long render_minor_faults;
+    atomic_long render_major_faults;
+    atomic_int active_voices;
+    atomic_int peak_voices;
+};
+
+static struct sample_clip bank[NUM_INTENSITY_LEVELS + 1];
+
+// The level whose clip plays each intensity. Without --filter-render every
+// level plays its own; with it only the source levels are loaded and the
+// rest are derived from the nearest one by filter, gain and rate.
+static int clip_source[NUM_INTENSITY_LEVELS + 1];
+static int bank_levels_total = NUM_INTENSITY_LEVELS;
+
+// The bank is loaded by a small worker pool while the engine already runs.
+// A level's clip is published by moving its state to LEVEL_READY (release).
+// Eagerly every level is queued at startup and triggers for levels not
+// ready yet are skipped; with --lazy-bank levels are queued on first use
+// or prefetched from the intensity trend, and playback waits for them.
+enum bank_level_state {
+    LEVEL_EMPTY,
+    LEVEL_QUEUED,
+    LEVEL_LOADING,
+    LEVEL_READY,
+    LEVEL_FAILED,
+};
+
+static atomic_int bank_state[NUM_INTENSITY_LEVELS + 1];
+static bool bank_urgent[NUM_INTENSITY_LEVELS + 1];
+static atomic_bool bank_prefetched[NUM_INTENSITY_LEVELS + 1];
+static atomic_int bank_levels_done;
+static bool bank_cancel = false;
+static bool bank_rate_fixed = false;
+static const char *bank_directory = NULL;
+static const uint8_t *packed_data = NULL;
+static size_t packed_size = 0;
+static pthread_mutex_t loader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loader_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t loader_thread_ids[MAX_LOADER_THREADS];
+static int loader_threads = 0;
+static struct timespec startup_time;
+
+// Reader-side intensity trend: the level at the start of the current
+// TREND_WINDOW_MS window. Anything above it counts as rising.
+static int trend_reference = NUM_INTENSITY_LEVELS;
+static struct timespec trend_window_start;
+
+struct bank_stats {
+    atomic_long hits;
+    atomic_long misses;
+    atomic_long prefetches;
+    atomic_long prefetches_used;
+    atomic_long waits;
+    atomic_long wait_ns;
+    atomic_long mapped_bytes;
+    atomic_long packed_bytes;
+    atomic_long pcm_bytes;
+    atomic_int locked_clips;
+};
+
+static struct bank_stats bank_stats;
+
+// Procedural voices for --synth, indexed by slot like the pool: a
+// glottal pulse train at f0 (Hz, following a per-voice contour) with
+// some breath noise, through SYNTH_FORMANTS parallel two-pole
+// resonators. A voice lasts length frames.
+struct synth_voices {
+    uint32_t elapsed[MAX_VOICES];
+    uint32_t length[MAX_VOICES];
+    uint32_t noise[MAX_VOICES];
+    float phase[MAX_VOICES];
+    float f0[MAX_VOICES];
+    float open_quotient[MAX_VOICES];
+    float breath[MAX_VOICES];
+    float a0[SYNTH_FORMANTS][MAX_VOICES];
+    float b1[SYNTH_FORMANTS][MAX_VOICES];
+    float b2[SYNTH_FORMANTS][MAX_VOICES];
+    float y1[SYNTH_FORMANTS][MAX_VOICES];
+    float y2[SYNTH_FORMANTS][MAX_VOICES];
+};
+
+// Formant frequency and bandwidth (Hz) and level of an open "oh"; the
+// first formant opens up by SYNTH_F1_PER_LEVEL Hz per intensity level.
+static const float synth_formants[SYNTH_FORMANTS][3] = {
+    { 620.0f, 90.0f, 1.0f },
+    { 1080.0f, 110.0f, 0.5f },
+    { 2650.0f, 160.0f, 0.22f },
+};
+#define SYNTH_F1_PER_LEVEL 15.0
+
+static struct voice_pool pool;
+static struct synth_voices synth;
+static struct voice_info voice_info[MAX_VOICES];
+static const struct output_backend *backend = NULL;
+static pthread_t render_thread_id;
+static struct timespec engine_start_time;
+
+// Single-producer (reader) single-consumer (render thread) trigger queue.
+static struct trigger trigger_queue[TRIGGER_QUEUE_SIZE];
+static atomic_uint trigger_head = 0;
+static atomic_uint trigger_tail = 0;
+static atomic_bool render_sleeping = false;
+static atomic_bool idle_requested = false;
+static atomic_bool output_failed = false;
+static atomic_bool output_down = false;
+static sem_t idle_request;
+static struct engine_stats engine = {0};
+
+static const struct latency_step latency_steps[] = {
+    { 64, 128 }, { 64, 256 }, { 128, 256 }, { 128, 512 }, { 256, 512 },
+    { 256, 1024 }, { 512, 1024 }, { 512, 2048 }, { 1024, 4096 },
+};
+#define NUM_LATENCY_STEPS ((int)(sizeof(latency_steps) / sizeof(latency_steps[0])))
+static struct latency_tuner tuner = {0};
+
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static struct debug_stats debug = {0};
 
+// Event-to-playback latency. Only the rendering thread writes it, with
+// relaxed atomic adds so it can do so from a real-time callback; readers
+// take a latency_snapshot() and diff snapshots to get a window.
+static struct latency_histogram trigger_latency = {0};
+
+// Per-second time series for --timeseries: a ring of the last
+// SERIES_SECONDS rows, written and dumped only by the stats thread from
+// deltas of the engine's cumulative counters. It wakes once a second while
+// there is activity and blocks while playback is idle; the seconds it
+// slept through are filled in as empty rows when it wakes.
+struct series_row {
+    int64_t time;
+    uint32_t events;
+    uint32_t frames;
+    uint32_t triggers[NUM_INTENSITY_LEVELS + 1];
+    uint32_t drops;
+    uint32_t xruns;
+    uint32_t p99_us;
+};
+
+static struct series_row series[SERIES_SECONDS];
+static unsigned long series_rows = 0;
+static pthread_t stats_thread_id;
+static atomic_bool stats_started;
+static sem_t stats_wakeup;
+static atomic_bool series_dump_requested;
+
+// Layout of the --stats-file file, in host byte order. The stats thread
+// keeps it at this session's totals plus what the file held at startup,
+// so the counts survive restarts and crashes. Readers map it and retry
+// while sequence is odd or changes under them. Latency histograms use the
+// buckets of struct latency_histogram, load the buckets of struct
+// load_histogram.
+struct stats_file {
+    char magic[8];
+    uint32_t size;
+    uint32_t levels;
+    uint64_t sequence;
+    int64_t sessions;
+    int64_t updated;
+    int64_t runtime_ms;
+    int64_t input_events;
+    int64_t frames_rendered;
+    int64_t drops;
+    int64_t xruns;
+    int64_t level_triggers[NUM_INTENSITY_LEVELS + 1];
+    int64_t trigger_latency_count;
+    int64_t trigger_latency_max_us;
+    int64_t trigger_latency[LATENCY_BUCKETS];
+    int64_t reader_delay_count;
+    int64_t reader_delay_max_us;
+    int64_t reader_delay[LATENCY_BUCKETS];
+    int64_t render_load_count;
+    int64_t render_load_max_permille;
+    int64_t render_load[LOAD_BUCKETS];
+};
+
+static struct stats_file *stats_map = NULL;
+static struct stats_file stats_base;
+
+// Reader scheduling delay: how long after the kernel stamped the newest
+// event of a batch the reader got to read it. Written by the reader only.
+static struct latency_histogram reader_delay = {0};
+
+// One report of one device: its events up to and including the
+// SYN_REPORT, stamped with that event's time.
+struct input_frame {
+    struct timespec time;
+    unsigned long sequence;
+    int count;
+    struct input_event events[FRAME_MAX_EVENTS];
+};
+
+// An input device and the frames read from it but not yet released to
+// process_event(). Only the reader touches these; the soak harness uses
+// the first one for its report rate.
+struct input_source {
+    const char *path;
+    int fd;
+    int clock_id;
+    struct input_frame frames[SOURCE_FRAMES];
+    unsigned long head;
+    unsigned long tail;
+    struct report_rate rate;
+};
+
+static struct input_source sources[MAX_INPUT_DEVICES];
+static int source_count = 0;
+
+// The fastest settled report rate, which --aggregate-ms auto follows.
+static const struct report_rate *fastest_rate = NULL;
+
+// How late each sound is heard relative to its target onset (event time
+// plus the onset target), written and read the same way.
+static struct latency_histogram onset_jitter = {0};
+static atomic_long onset_target_frames;
+
+// Render CPU budget, written like the latency histograms. Periods whose
+// headroom falls below --headroom-warn are counted per window, and a
+// warning is printed outside the real-time path once per window.
+static struct load_histogram render_load = {0};
+static atomic_long low_headroom_periods;
+static atomic_long headroom_warn_count;
+static atomic_long headroom_warn_worst;
+static atomic_bool headroom_warning_pending;
+
+// Load shedding. Each level keeps the ones below it: 1 halves the voice
+// count, 2 resamples by nearest neighbour instead of linear interpolation,
+// 3 widens the input aggregation window. The render side and the reader
+// read degrade_level; only degrade_update() changes it.
+static const char *degrade_steps[DEGRADE_MAX_LEVEL + 1] = {
+    "full quality",
+    "fewer voices",
+    "nearest-neighbour resampling",
+    "wider input aggregation",
+};
+
+struct degrade_state {
+    int cpu_stat_fd;
+    double quota_cpus;
+    long last_usage_us;
+    struct timespec last_check;
+    int calm_windows;
+    long steps_down;
+    long steps_up;
+    long level_us[DEGRADE_MAX_LEVEL + 1];
+    struct timespec level_since;
+};
+
+static atomic_int degrade_level;
+static atomic_long pressure_window_worst;
+static atomic_bool pressure_check_pending;
+static struct degrade_state degrade = { .cpu_stat_fd = -1 };
+
+static struct soak_config soak = {
+    .duration = 0,
+    .interval = DEFAULT_SOAK_INTERVAL,
+    .event_rate = DEFAULT_SOAK_RATE,
+    .max_rss_growth_kb = DEFAULT_SOAK_MAX_RSS_GROWTH_KB,
+    .max_fd_growth = DEFAULT_SOAK_MAX_FD_GROWTH,
+    .max_thread_growth = DEFAULT_SOAK_MAX_THREAD_GROWTH,
+    .max_latency_drift = DEFAULT_SOAK_MAX_LATENCY_DRIFT,
+};
+
 void list_input_devices(void);
-void *sound_player_thread(void *unused);
-void monitor_device(const char *device_path);
+void probe_report_rates(void);
+void *render_thread(void *unused);
+void monitor_devices(void);
 static inline int calculate_intensity(int dx, int dy);
-void play_sound_file(int intensity);
+bool load_wav_file(const char *path, struct sample_clip *clip);
+int pack_sound_bank(const char *dir_path, const char *out_path);
+bool load_sound_bank(const char *dir_path);
+void wait_sound_bank(void);
+void free_sound_bank(void);
+void startup_mark(const char *fmt, ...);
+float *bank_alloc(size_t bytes, struct sample_clip *clip);
+const struct mix_kernels *select_mix_kernels(void);
+int run_benchmark(void);
+void mix_period(int16_t *out, size_t frames);
+bool engine_render(int16_t *out, size_t frames);
+void engine_render_callback(int16_t *out, size_t frames);
+void engine_render_float_callback(float *left, float *right, size_t frames);
+void engine_output_failed(void);
+bool engine_start(void);
+void engine_stop(void);
+void engine_trigger(int level, const struct timespec *time);
+const struct output_backend *find_backend(const char *name);
+const char *backend_names(void);
+bool add_sink(const char *spec);
+int shm_consume(const char *path);
+void print_sink_stats(void);
+bool event_stream_open(void);
+void print_event_stream_stats(void);
 void print_usage(const char *program_name);
 void print_debug_stats(void);
+void report_low_headroom(void);
+void degrade_update(long worst_permille);
 void handle_signal(int sig);
+bool map_clip_sources(void);
+bool validate_packed_bank(const char *path);
 bool validate_sound_directory(const char *dir_path);
 void print_version(void);
+void process_event(const struct input_event *ev, int source);
+void latency_record(struct latency_histogram *h, long us);
+void load_record(struct load_histogram *h, long permille);
+double headroom_percentile(const struct load_histogram *h, double pct);
+long latency_percentile(const struct latency_histogram *h, double pct);
+void latency_snapshot(struct latency_histogram *dst, const struct latency_histogram *src);
+void latency_window(struct latency_histogram *later, const struct latency_histogram *earlier);
+void report_rate_update(struct report_rate *r, const struct timespec *time);
+bool sample_process(struct process_sample *sample);
+int run_soak(const char *capture_path);
 
 void print_version(void) {
     printf("supermoan version %s\n", SUPERMOAN_VERSION);
@@ -81,14 +723,51 @@ void print_usage(const char *program_name) {
     printf("Usage: %s -i <device> [OPTIONS]\n", program_name);
     printf("Options:\n");
     printf("  -l, --list-devices      List all available input devices\n");
-    printf("  -i, --input <device>    Specify input device path (required)\n");
+    printf("      --probe-rate MS     With -l, watch the devices for MS and show their report rate and jitter\n");
+    printf("  -i, --input <device>    Specify input device path (required; repeat for up to %d devices)\n",
+           MAX_INPUT_DEVICES);
+    printf("      --reorder-us US     Hold input from several devices up to US to merge it in time order (default: %d)\n",
+           DEFAULT_REORDER_US);
     printf("  -d, --debug             Enable debug output\n");
     printf("  -m, --min-threshold N   Set minimum movement threshold (default: %.1f)\n", DEFAULT_MIN_THRESHOLD);
     printf("  -M, --max-threshold N   Set maximum movement threshold (default: %.1f)\n", DEFAULT_MAX_THRESHOLD);
     printf("  -b, --log-base N        Set logarithm base for scaling (default: %.1f)\n", DEFAULT_LOG_BASE);
     printf("  -n, --no-sound          Don't play sound files (for testing)\n");
     printf("  -s, --sound-dir <path>  Specify custom folder containing wav files (default: %s)\n", DEFAULT_SOUND_DIR);
+    printf("  -o, --backend <name>    Audio output backend: %s (default: %s)\n", backend_names(), DEFAULT_BACKEND);
+    printf("  -D, --audio-device <d>  Audio device passed to the backend (default: system default)\n");
+    printf("      --tee OUTPUT        Also send the mix to wav:FILE, alsa:DEVICE or shm:SOCKET (repeat for up to %d)\n",
+           MAX_SINKS);
+    printf("      --events OUTPUT     Write a binary record per trigger to -, a FIFO, a file or unix:SOCKET\n");
+    printf("      --shm-consume SOCKET  Attach to a shm: output of another instance and write its audio to stdout\n");
+    printf("      --rate N            Output sample rate (default: %d)\n", DEFAULT_SAMPLE_RATE);
+    printf("      --period-frames N   Frames rendered per period (default: %d)\n", DEFAULT_PERIOD_FRAMES);
+    printf("      --buffer-frames N   Device buffer size in frames (default: %d)\n", DEFAULT_BUFFER_FRAMES);
+    printf("      --adaptive-latency  Start with tiny buffers and grow them on xruns\n");
+    printf("      --lock-bank         Fault in and lock the sound bank in memory at startup\n");
+    printf("      --lazy-bank         Load sound levels on first use, prefetching while intensity rises\n");
+    printf("      --huge-pages MODE   Back the sound bank with huge pages: off, thp, explicit (default: off)\n");
+    printf("      --filter-render L   Load only levels L (e.g. 10 or 1,5,10) and filter them into the rest\n");
+    printf("      --synth             Synthesize the sounds instead of loading the wav files\n");
+    printf("      --pack-bank FILE    Losslessly compress the sound directory's wav files into FILE and exit\n");
+    printf("      --voices N          Sounds that may play at once, 1-%d (default: %d)\n", MAX_VOICES, DEFAULT_VOICES);
+    printf("      --idle-timeout MS   Quiet period before playback goes idle (default: %d)\n", DEFAULT_IDLE_TIMEOUT_MS);
+    printf("      --aggregate-ms MS   Sum motion over MS milliseconds per trigger, or auto to size the window\n");
+    printf("                          from the device's report rate (default: 0, every event)\n");
+    printf("      --headroom-warn PCT Warn when render CPU headroom drops below PCT%% (default: %.0f)\n", DEFAULT_HEADROOM_WARN);
+    printf("      --reader-delay-bound US  Count input batches read more than US after their newest event (default: %d)\n",
+           DEFAULT_READER_DELAY_BOUND_US);
+    printf("      --timeseries FILE   Keep per-second metrics for the last hour; SIGUSR1 writes them to FILE as CSV\n");
+    printf("      --stats-file FILE   Keep cumulative counters and histograms in FILE across restarts\n");
     printf("  -v, --version           Display version information\n");
+    printf("      --soak SECONDS      Run the soak harness for SECONDS; with -i, replay it as a capture\n");
+    printf("      --soak-interval N   Seconds between soak samples (default: %.0f)\n", DEFAULT_SOAK_INTERVAL);
+    printf("      --soak-rate N       Synthetic events per second (default: %.0f)\n", DEFAULT_SOAK_RATE);
+    printf("      --soak-max-rss KB   Allowed RSS growth over baseline (default: %d)\n", DEFAULT_SOAK_MAX_RSS_GROWTH_KB);
+    printf("      --soak-max-fds N    Allowed open fd growth over baseline (default: %d)\n", DEFAULT_SOAK_MAX_FD_GROWTH);
+    printf("      --soak-max-threads N  Allowed thread count growth over baseline (default: %d)\n", DEFAULT_SOAK_MAX_THREAD_GROWTH);
+    printf("      --soak-max-drift N  Allowed p99 latency ratio over baseline (default: %.1f)\n", DEFAULT_SOAK_MAX_LATENCY_DRIFT);
+    printf("      --benchmark         Time the mixer kernels and voice rendering on this CPU and exit\n");
     printf("  -h, --help              Display this help message\n");
     printf("\nUse -l to list available devices\n");
 }
@@ -123,6 +802,48 @@ void list_input_devices(void) {
         }
     }
     closedir(dir);
+
+    if (probe_rate_ms > 0) probe_report_rates();
+}
+
+// Fills clip_source: every level plays itself, or with --filter-render
+// the nearest listed level, the lower one on a tie.
+bool map_clip_sources(void) {
+    bool listed[NUM_INTENSITY_LEVELS + 1] = {false};
+    bank_levels_total = 0;
+
+    if (filter_render) {
+        const char *p = filter_render;
+        do {
+            char *end;
+            long level = strtol(p, &end, 10);
+            if (end == p || level < 1 || level > NUM_INTENSITY_LEVELS || (*end && *end != ',')) {
+                return false;
+            }
+            if (!listed[level]) bank_levels_total++;
+            listed[level] = true;
+            p = *end ? end + 1 : end;
+        } while (*p);
+    }
+
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        if (!filter_render) {
+            clip_source[level] = level;
+            bank_levels_total++;
+            continue;
+        }
+        for (int d = 0; d < NUM_INTENSITY_LEVELS; d++) {
+            if (level - d >= 1 && listed[level - d]) {
+                clip_source[level] = level - d;
+                break;
+            }
+            if (level + d <= NUM_INTENSITY_LEVELS && listed[level + d]) {
+                clip_source[level] = level + d;
+                break;
+            }
+        }
+    }
+    return true;
 }
 
 bool validate_sound_directory(const char *dir_path) {
@@ -139,8 +860,14 @@ bool validate_sound_directory(const char *dir_path) {
         return false;
     }
 
+    snprintf(sound_path_buffer, sizeof(sound_path_buffer), "%s/%s", dir_path, PACKED_BANK_NAME);
+    if (access(sound_path_buffer, F_OK) == 0) {
+        return validate_packed_bank(sound_path_buffer);
+    }
+
     bool missing_files = false;
     for (int i = 1; i <= NUM_INTENSITY_LEVELS; i++) {
+        if (clip_source[i] != i) continue;
         snprintf(sound_path_buffer, sizeof(sound_path_buffer), "%s/%d.wav", dir_path, i);
         if (access(sound_path_buffer, R_OK) != 0) {
             fprintf(stderr, "Error: Missing or unreadable sound file: %s\n", sound_path_buffer);
@@ -149,8 +876,12 @@ bool validate_sound_directory(const char *dir_path) {
     }
 
     if (missing_files) {
-        fprintf(stderr, "Error: Sound directory must contain wav files named 1.wav through %d.wav\n", 
-                NUM_INTENSITY_LEVELS);
+        if (filter_render) {
+            fprintf(stderr, "Error: Sound directory must contain the wav files of levels %s\n", filter_render);
+        } else {
+            fprintf(stderr, "Error: Sound directory must contain wav files named 1.wav through %d.wav\n", 
+                    NUM_INTENSITY_LEVELS);
+        }
         return false;
     }
 
@@ -196,24 +927,187 @@ static inline int calculate_intensity(int dx, int dy) {
     return intensity;
 }
 
-void play_sound_file(int intensity) {
-    if (debug.enabled) {
-        printf("DEBUG: Playing sound from directory: %s, intensity: %d\n", sound_directory, intensity);
+static inline long timespec_diff_us(const struct timespec *a, const struct timespec *b) {
+    return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_nsec - b->tv_nsec) / 1000L;
+}
+
+void latency_record(struct latency_histogram *h, long us) {
+    if (us < 0) us = 0;
+
+    int index;
+    if (us < LATENCY_SUB_BUCKETS) {
+        index = (int)us;
+    } else {
+        int octave = 63 - __builtin_clzl((unsigned long)us);
+        int sub = (int)((us >> (octave - 3)) & (LATENCY_SUB_BUCKETS - 1));
+        index = (octave - 2) * LATENCY_SUB_BUCKETS + sub;
     }
+    if (index >= LATENCY_BUCKETS) index = LATENCY_BUCKETS - 1;
 
-    if (!no_sound) {
-        snprintf(sound_path_buffer, sizeof(sound_path_buffer), 
-                "aplay %s/%d.wav 2>/dev/null", sound_directory, intensity);
-        
-        if (debug.enabled) {
-            printf("DEBUG: Executing command: %s\n", sound_path_buffer);
+    __atomic_fetch_add(&h->buckets[index], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    if (us > __atomic_load_n(&h->max_us, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max_us, us, __ATOMIC_RELAXED);
+    }
+}
+
+void load_record(struct load_histogram *h, long permille) {
+    if (permille < 0) permille = 0;
+    long index = permille / LOAD_BUCKET_PERMILLE;
+    if (index >= LOAD_BUCKETS) index = LOAD_BUCKETS - 1;
+
+    __atomic_fetch_add(&h->buckets[index], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    if (permille > __atomic_load_n(&h->max_permille, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max_permille, permille, __ATOMIC_RELAXED);
+    }
+}
+
+// The headroom, in percent, that pct percent of periods stayed above:
+// headroom_percentile(h, 1.0) is the headroom left in all but the worst
+// 1% of periods. Negative when a period took longer than it lasts.
+double headroom_percentile(const struct load_histogram *h, double pct) {
+    long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (count == 0) return 100.0;
+
+    long target = (long)ceil(count * (100.0 - pct) / 100.0);
+    long seen = 0;
+    for (int i = 0; i < LOAD_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            long permille = (i + 1) * LOAD_BUCKET_PERMILLE;
+            long max = __atomic_load_n(&h->max_permille, __ATOMIC_RELAXED);
+            return 100.0 - (permille < max ? permille : max) / 10.0;
+        }
+    }
+    return 100.0 - __atomic_load_n(&h->max_permille, __ATOMIC_RELAXED) / 10.0;
+}
+
+void latency_snapshot(struct latency_histogram *dst, const struct latency_histogram *src) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->max_us = __atomic_load_n(&src->max_us, __ATOMIC_RELAXED);
+}
+
+// Turns a later snapshot into the window since an earlier one. The
+// window keeps the overall maximum, which only caps the top percentile.
+void latency_window(struct latency_histogram *later, const struct latency_histogram *earlier) {
+    long count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        later->buckets[i] -= earlier->buckets[i];
+        count += later->buckets[i];
+    }
+    later->count = count;
+}
+
+void report_rate_update(struct report_rate *r, const struct timespec *time) {
+    long us = timespec_diff_us(time, &r->last);
+    r->last = *time;
+    if (r->reports++ == 0 || us <= 0 || us > REPORT_GAP_US) return;
+
+    double interval = us;
+    if (r->intervals > 0) {
+        double polls = round(interval / r->interval_us);
+        if (polls > REPORT_MAX_FOLD) return;
+        if (polls >= 2.0) interval /= polls;
+
+        double deviation = fabs(interval - r->interval_us);
+        r->jitter_us += (deviation - r->jitter_us) * REPORT_RATE_WEIGHT;
+        latency_record(&r->deviation, lround(deviation));
+    }
+
+    // Plain averaging until there are enough intervals to weight, and a
+    // quick pull down if the first intervals were several polls long.
+    double weight = 1.0 / (r->intervals + 1);
+    if (weight < REPORT_RATE_WEIGHT) weight = REPORT_RATE_WEIGHT;
+    if (interval < r->interval_us * 0.75) weight = 0.5;
+    r->interval_us += (interval - r->interval_us) * weight;
+    r->intervals++;
+}
+
+// With --probe-rate, watches every readable device for a while and shows
+// the report rate of those that were moved in the meantime.
+void probe_report_rates(void) {
+    DIR *dir = opendir(DEV_INPUT_PATH);
+    if (!dir) return;
+
+    struct pollfd fds[PROBE_MAX_DEVICES];
+    char paths[PROBE_MAX_DEVICES][DEVICE_PATH_MAX];
+    struct report_rate *rates = calloc(PROBE_MAX_DEVICES, sizeof(*rates));
+    if (!rates) {
+        closedir(dir);
+        return;
+    }
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < PROBE_MAX_DEVICES) {
+        if (strncmp(entry->d_name, EVENT_PREFIX, strlen(EVENT_PREFIX)) != 0) continue;
+        snprintf(paths[count], sizeof(paths[count]), "%s/%s", DEV_INPUT_PATH, entry->d_name);
+        int fd = open(paths[count], O_RDONLY | O_NONBLOCK);
+        if (fd < 0) continue;
+        fds[count].fd = fd;
+        fds[count].events = POLLIN;
+        count++;
+    }
+    closedir(dir);
+
+    printf("\nMove the devices to measure; watching for %ld ms...\n", probe_rate_ms);
+    fflush(stdout);
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    now = start;
+    struct input_event events[READ_BATCH];
+    long remaining_ms;
+    while ((remaining_ms = probe_rate_ms - timespec_diff_us(&now, &start) / 1000) > 0) {
+        if (poll(fds, (nfds_t)count, (int)remaining_ms) < 0 && errno != EINTR) break;
+        for (int i = 0; i < count; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            ssize_t n;
+            while ((n = read(fds[i].fd, events, sizeof(events))) >= (ssize_t)sizeof(struct input_event)) {
+                for (size_t e = 0; e < (size_t)n / sizeof(struct input_event); e++) {
+                    if (events[e].type != EV_SYN || events[e].code != SYN_REPORT) continue;
+                    struct timespec time = {
+                        .tv_sec = events[e].input_event_sec,
+                        .tv_nsec = events[e].input_event_usec * 1000L,
+                    };
+                    report_rate_update(&rates[i], &time);
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    for (int i = 0; i < count; i++) {
+        close(fds[i].fd);
+        if (rates[i].intervals < REPORT_RATE_SETTLED) continue;
+        printf("Path: %-20s | %6.0f Hz | jitter mean %.0f us, p99 %ld us | %ld reports\n",
+               paths[i], 1e6 / rates[i].interval_us, rates[i].jitter_us,
+               latency_percentile(&rates[i].deviation, 99.0), rates[i].reports);
+    }
+    free(rates);
+}
+
+// Returns the upper bound of the bucket holding the given percentile.
+long latency_percentile(const struct latency_histogram *h, double pct) {
+    if (h->count == 0) return 0;
+
+    long target = (long)ceil(h->count * pct / 100.0);
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            if (i < LATENCY_SUB_BUCKETS) return i;
+            int octave = i / LATENCY_SUB_BUCKETS + 2;
+            long base = 1L << octave;
+            long upper = base + ((long)(i % LATENCY_SUB_BUCKETS + 1) << (octave - 3)) - 1;
+            return upper < h->max_us ? upper : h->max_us;
         }
-        
-        system(sound_path_buffer);
-    } else if (debug.enabled) {
-        printf("DEBUG: Sound playback disabled, would have played: %s/%d.wav\n", 
-               sound_directory, intensity);
     }
+    return h->max_us;
 }
 
 void print_debug_stats(void) {
@@ -243,132 +1137,5291 @@ void print_debug_stats(void) {
         printf("\n");
     }
     printf("\n");
-}
 
-void handle_signal(int sig) {
-    if (sig == SIGINT) {
-        printf("\nReceived SIGINT, shutting down...\n");
-        running = false;
-        pthread_cond_broadcast(&cond);
-        print_debug_stats();
-        exit(0);
+    if (stats_map) {
+        printf("Triggers per level over %lld sessions (%s):\n ",
+               (long long)__atomic_load_n(&stats_map->sessions, __ATOMIC_RELAXED), stats_path);
+        for (int i = 1; i <= NUM_INTENSITY_LEVELS; i++) {
+            printf(" %d: %lld", i, (long long)__atomic_load_n(&stats_map->level_triggers[i], __ATOMIC_RELAXED));
+        }
+        printf("\n\n");
     }
-}
 
-void *sound_player_thread(void *unused) {
-    (void)unused;
+    struct latency_histogram latency;
+    latency_snapshot(&latency, &trigger_latency);
+    if (latency.count > 0) {
+        printf("Trigger latency (event to playback start, %ld triggers):\n", latency.count);
+        printf("  p50: %ld us  p90: %ld us  p99: %ld us  max: %ld us\n\n",
+               latency_percentile(&latency, 50.0),
+               latency_percentile(&latency, 90.0),
+               latency_percentile(&latency, 99.0),
+               latency.max_us);
+    }
 
-    while (running) {
-        pthread_mutex_lock(&mutex);
+    latency_snapshot(&latency, &reader_delay);
+    if (latency.count > 0) {
+        printf("Reader scheduling delay (newest event to read, %ld batches):\n", latency.count);
+        printf("  p50: %ld us  p90: %ld us  p99: %ld us  max: %ld us  over %ld us: %ld batches\n\n",
+               latency_percentile(&latency, 50.0),
+               latency_percentile(&latency, 90.0),
+               latency_percentile(&latency, 99.0),
+               latency.max_us, reader_delay_bound_us,
+               atomic_load(&engine.reader_delays_over_bound));
+    }
 
-        while (current_intensity == 0 && running) {
-            pthread_cond_wait(&cond, &mutex);
+    for (int i = 0; i < source_count; i++) {
+        const struct report_rate *rate = &sources[i].rate;
+        if (rate->intervals == 0) continue;
+        printf("Input report rate of %s (%ld reports):\n", rate->name, rate->reports);
+        printf("  %.0f Hz (%.0f us)  jitter mean: %.0f us  p50: %ld us  p99: %ld us\n\n",
+               1e6 / rate->interval_us, rate->interval_us, rate->jitter_us,
+               latency_percentile(&rate->deviation, 50.0),
+               latency_percentile(&rate->deviation, 99.0));
+    }
+
+    if (source_count > 1) {
+        printf("Input merge (%ld frames from %d devices, %ld us reorder delay):\n",
+               atomic_load(&engine.input_frames), source_count, reorder_us);
+        printf("  reordered: %ld  late: %ld  released early, buffer full: %ld\n\n",
+               atomic_load(&engine.input_frames_reordered), atomic_load(&engine.input_frames_late),
+               atomic_load(&engine.input_frames_forced));
+    }
+
+    latency_snapshot(&latency, &onset_jitter);
+    if (latency.count > 0) {
+        printf("Onset jitter (lateness against a %ld frame onset target):\n", onset_target_frames);
+        printf("  p50: %ld us  p90: %ld us  p99: %ld us  max: %ld us\n\n",
+               latency_percentile(&latency, 50.0),
+               latency_percentile(&latency, 90.0),
+               latency_percentile(&latency, 99.0),
+               latency.max_us);
+    }
+
+    if (render_load.count > 0) {
+        printf("Render headroom (CPU time left per period, %ld periods):\n", render_load.count);
+        printf("  p50: %.1f%%  p10: %.1f%%  p1: %.1f%%  min: %.1f%%  below %g%%: %ld periods\n\n",
+               headroom_percentile(&render_load, 50.0), headroom_percentile(&render_load, 10.0),
+               headroom_percentile(&render_load, 1.0), 100.0 - render_load.max_permille / 10.0,
+               headroom_warn_pct, atomic_load(&low_headroom_periods));
+    }
+
+    if (engine_start_time.tv_sec == 0) return;
+
+    if (degrade.steps_down > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int level = atomic_load(&degrade_level);
+        printf("Load shedding: %ld steps down, %ld steps up, now at %s\n",
+               degrade.steps_down, degrade.steps_up, degrade_steps[level]);
+        for (int i = 0; i <= DEGRADE_MAX_LEVEL; i++) {
+            long us = degrade.level_us[i] + (i == level ? timespec_diff_us(&now, &degrade.level_since) : 0);
+            printf("  %-30s %.1f s\n", degrade_steps[i], us / 1e6);
         }
+        printf("\n");
+    }
 
-        if (!running) {
-            pthread_mutex_unlock(&mutex);
-            break;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double runtime = timespec_diff_us(&now, &engine_start_time) / 1e6;
+    double idle = atomic_load(&engine.idle_ns) / 1e9;
+    double active = runtime - idle > 0 ? runtime - idle : 0;
+    printf("Wakeups over %.1f s (%.1f s idle in %ld idle periods):\n",
+           runtime, idle, atomic_load(&engine.idle_entries));
+    printf("  reader: %.1f/s\n", runtime > 0 ? atomic_load(&engine.reader_wakeups) / runtime : 0.0);
+    printf("  render: %.1f/s while active, %ld wakeups while idle\n",
+           active > 0 ? atomic_load(&engine.render_wakeups) / active : 0.0,
+           atomic_load(&engine.render_idle_wakeups));
+    printf("Triggers dropped: %ld (queue full), %ld (output down), %ld (level still loading)\n",
+           atomic_load(&engine.triggers_dropped), atomic_load(&engine.triggers_dropped_outage),
+           atomic_load(&engine.triggers_skipped_loading));
+    if (synth_render) {
+        printf("Sound bank: none, sounds are synthesized\n");
+    } else {
+        printf("Sound bank: %.1f MB of float32 planes, %d of %d clips locked, huge pages: %s\n",
+               atomic_load(&bank_stats.mapped_bytes) / 1048576.0, atomic_load(&bank_stats.locked_clips),
+               bank_levels_total, huge_pages);
+        long packed_bytes = atomic_load(&bank_stats.packed_bytes);
+        if (packed_bytes > 0) {
+            long pcm_bytes = atomic_load(&bank_stats.pcm_bytes);
+            printf("Packed bank: %.1f MB of PCM unpacked from %.1f MB (%.1f%%)\n",
+                   pcm_bytes / 1048576.0, packed_bytes / 1048576.0, 100.0 * packed_bytes / pcm_bytes);
+        }
+        if (filter_render) {
+            printf("Filter render: %d of %d levels loaded (from %s), the rest filtered\n",
+                   bank_levels_total, NUM_INTENSITY_LEVELS, filter_render);
+        }
+        long hits = atomic_load(&bank_stats.hits), misses = atomic_load(&bank_stats.misses);
+        printf("Sound bank lookups: %ld hits, %ld misses (%.1f%% hit rate)\n", hits, misses,
+               hits + misses > 0 ? 100.0 * hits / (hits + misses) : 100.0);
+        if (lazy_bank) {
+            printf("Prefetches: %ld issued, %ld used; playback waited %ld times, %.1f ms in total\n",
+                   atomic_load(&bank_stats.prefetches), atomic_load(&bank_stats.prefetches_used),
+                   atomic_load(&bank_stats.waits), atomic_load(&bank_stats.wait_ns) / 1e6);
+        }
+    }
+    if (max_voices > 1) {
+        printf("Plays per voice slot:");
+        for (int i = 0; i < max_voices; i++) {
+            printf(" %ld", voice_info[i].plays);
+        }
+        printf("\n");
+    }
+    printf("Render thread page faults: %ld minor, %ld major\n",
+           atomic_load(&engine.render_minor_faults), atomic_load(&engine.render_major_faults));
+    printf("Output errors: %ld, reopen attempts: %ld, total outage: %.1f s\n",
+           atomic_load(&engine.device_errors), atomic_load(&engine.reopen_attempts),
+           atomic_load(&engine.outage_ns) / 1e9);
+    print_sink_stats();
+    print_event_stream_stats();
+    printf("\n");
+
+    if (adaptive_latency) {
+        printf("Adaptive latency: period %d, buffer %d frames (%.1f ms) after %d adjustment(s)\n",
+               period_frames, buffer_frames, buffer_frames * 1000.0 / sample_rate, tuner.adjustments);
+        int first = tuner.adjustments > ADAPT_HISTORY ? tuner.adjustments - ADAPT_HISTORY : 0;
+        for (int i = first; i < tuner.adjustments; i++) {
+            const struct latency_adjustment *a = &tuner.history[i % ADAPT_HISTORY];
+            printf("  %8.1f s: %d/%d -> %d/%d frames (%ld xruns, render load %.0f%%)\n", a->at,
+                   latency_steps[a->from].period, latency_steps[a->from].buffer,
+                   latency_steps[a->to].period, latency_steps[a->to].buffer, a->xruns, a->load * 100.0);
         }
+        printf("\n");
+    }
+}
 
-        int intensity_to_play = current_intensity;
-        current_intensity = 0;
-        is_playing = true;
+// Only flags the shutdown; the main thread stops the engine, which joins
+// the threads and finishes the output files, and prints the statistics.
+void handle_signal(int sig) {
+    if (sig == SIGINT) {
+        int saved_errno = errno;
+        running = false;
+        if (shutdown_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t n = write(shutdown_fd, &one, sizeof(one));
+            (void)n;
+        }
+        errno = saved_errno;
+    } else if (sig == SIGUSR1) {
+        atomic_store(&series_dump_requested, true);
+        sem_post(&stats_wakeup);
+    }
+}
 
-        pthread_mutex_unlock(&mutex);
+static inline uint32_t read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-        play_sound_file(intensity_to_play);
+static inline uint16_t read_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
 
-        pthread_mutex_lock(&mutex);
-        is_playing = false;
-        pthread_mutex_unlock(&mutex);
+static inline void write_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline void write_le16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline float decode_wav_sample(const uint8_t *p, int format, int bits) {
+    if (format == 3) {
+        float value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+    switch (bits) {
+        case 8:  return ((int)p[0] - 128) / 128.0f;
+        case 16: return (int16_t)read_le16(p) / 32768.0f;
+        case 24: return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) / 2147483648.0f;
+        default: return (int32_t)read_le32(p) / 2147483648.0f;
     }
-    return NULL;
 }
 
-void monitor_device(const char *device_path) {
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGINT);
-    pthread_sigmask(SIG_BLOCK, &set, NULL);
+// A WAV file read into memory. pcm points into data, which the caller
+// frees.
+struct wav_data {
+    uint8_t *data;
+    const uint8_t *pcm;
+    size_t frames;
+    uint32_t rate;
+    int format;
+    int bits;
+    int channels;
+};
 
-    pthread_t player_thread;
-    if (pthread_create(&player_thread, NULL, sound_player_thread, NULL) != 0) {
-        perror("Failed to create sound player thread");
-        return;
+static bool read_wav(const char *path, struct wav_data *wav) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open sound file %s: %s\n", path, strerror(errno));
+        return false;
     }
 
-    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = size > 12 ? malloc((size_t)size) : NULL;
+    if (!data || fread(data, 1, (size_t)size, f) != (size_t)size) {
+        fprintf(stderr, "Error: Failed to read sound file %s\n", path);
+        free(data);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
 
-    int fd = open(device_path, O_RDONLY);
-    if (fd < 0) {
-        perror("Failed to open device");
-        pthread_cancel(player_thread);
-        pthread_join(player_thread, NULL);
-        return;
+    if (memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "Error: %s is not a RIFF/WAVE file\n", path);
+        free(data);
+        return false;
     }
 
-    struct input_event ev;
-    while (running) {
-        ssize_t n = read(fd, &ev, sizeof(struct input_event));
-        if (n < (ssize_t)sizeof(struct input_event)) {
-            if (running) {
-                perror("Error reading input event");
+    int format = 0, channels = 0, bits = 0;
+    uint32_t rate = 0;
+    const uint8_t *pcm = NULL;
+    uint32_t pcm_size = 0;
+
+    long offset = 12;
+    while (offset + 8 <= size) {
+        const uint8_t *chunk = data + offset;
+        uint32_t chunk_size = read_le32(chunk + 4);
+        long body = offset + 8;
+        if (chunk_size > (uint32_t)(size - body)) chunk_size = (uint32_t)(size - body);
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16) {
+            format = read_le16(data + body);
+            channels = read_le16(data + body + 2);
+            rate = read_le32(data + body + 4);
+            bits = read_le16(data + body + 14);
+            if (format == 0xFFFE && chunk_size >= 26) {
+                format = read_le16(data + body + 24);
             }
-            break;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            pcm = data + body;
+            pcm_size = chunk_size;
         }
+        offset = body + chunk_size + (chunk_size & 1);
+    }
+
+    bool supported = (format == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32)) ||
+                     (format == 3 && bits == 32);
+    if (!pcm || !supported || channels < 1 || rate == 0) {
+        fprintf(stderr, "Error: %s has an unsupported format (format %d, %d bit, %d channels)\n",
+                path, format, bits, channels);
+        free(data);
+        return false;
+    }
+
+    wav->data = data;
+    wav->pcm = pcm;
+    wav->frames = pcm_size / (channels * (bits / 8));
+    wav->rate = rate;
+    wav->format = format;
+    wav->bits = bits;
+    wav->channels = channels;
+    return true;
+}
 
-        if (ev.type == EV_REL) {
-            if (ev.code == REL_X || ev.code == REL_Y) {
-                int dx = (ev.code == REL_X) ? ev.value : 0;
-                int dy = (ev.code == REL_Y) ? ev.value : 0;
+// Converts interleaved PCM or float samples to the engine format: mono
+// stays a single plane, channels beyond two are dropped and the rate is
+// converted by linear interpolation.
+static bool clip_from_pcm(const char *path, const struct wav_data *wav, struct sample_clip *clip) {
+    const uint8_t *pcm = wav->pcm;
+    int format = wav->format, bits = wav->bits, channels = wav->channels;
+    uint32_t rate = wav->rate;
+    int frame_bytes = channels * (bits / 8);
+    size_t in_frames = wav->frames;
+    size_t out_frames = (size_t)((double)in_frames * sample_rate / rate);
+    // Planes start on 64-byte boundaries so the kernels' loads stay within
+    // cache lines.
+    int planes = channels == 1 ? 1 : ENGINE_CHANNELS;
+    size_t stride = (out_frames + 15) & ~(size_t)15;
+    float *out = bank_alloc(planes * stride * sizeof(float), clip);
+    if (!out) {
+        fprintf(stderr, "Error: Out of memory loading %s\n", path);
+        return false;
+    }
 
-                int new_intensity = calculate_intensity(dx, dy);
+    double step = (double)rate / sample_rate;
+    for (size_t i = 0; i < out_frames; i++) {
+        double source = i * step;
+        size_t index = (size_t)source;
+        float frac = (float)(source - index);
+        size_t next = index + 1 < in_frames ? index + 1 : index;
 
-                pthread_mutex_lock(&mutex);
-                if (!is_playing || new_intensity != current_intensity) {
-                    current_intensity = new_intensity;
-                    pthread_cond_signal(&cond);
-                }
-                pthread_mutex_unlock(&mutex);
-            }
+        for (int c = 0; c < planes; c++) {
+            float a = decode_wav_sample(pcm + index * frame_bytes + c * (bits / 8), format, bits);
+            float b = decode_wav_sample(pcm + next * frame_bytes + c * (bits / 8), format, bits);
+            out[c * stride + i] = a + (b - a) * frac;
         }
     }
 
-    close(fd);
-    pthread_cancel(player_thread);
-    pthread_join(player_thread, NULL);
+    for (int c = 0; c < ENGINE_CHANNELS; c++) {
+        clip->planes[c] = out + (c < planes ? c : 0) * stride;
+    }
+    clip->channels = planes;
+    clip->rate = sample_rate;
+    clip->length = out_frames;
+    return true;
 }
 
-int main(int argc, char *argv[]) {
-    static struct option long_options[] = {
-        {"list-devices", no_argument, 0, 'l'},
-        {"input", required_argument, 0, 'i'},
-        {"debug", no_argument, 0, 'd'},
-        {"help", no_argument, 0, 'h'},
-        {"version", no_argument, 0, 'v'},
-        {"min-threshold", required_argument, 0, 'm'},
-        {"max-threshold", required_argument, 0, 'M'},
-        {"log-base", required_argument, 0, 'b'},
-        {"no-sound", no_argument, 0, 'n'},
-        {"sound-dir", required_argument, 0, 's'},
-        {0, 0, 0, 0}
-    };
+// Loads a PCM or float WAV file and converts it to the engine format.
+bool load_wav_file(const char *path, struct sample_clip *clip) {
+    struct wav_data wav;
+    if (!read_wav(path, &wav)) return false;
+    bool loaded = clip_from_pcm(path, &wav, clip);
+    free(wav.data);
+    return loaded;
+}
 
-    const char *device_path = NULL;
-    int opt;
-    bool list_requested = false;
+// Packed bank (PACKED_BANK_NAME in the sound directory, written by
+// --pack-bank): the integer PCM of every level, losslessly compressed.
+//
+//   header  PACKED_MAGIC (8 bytes), u32 levels
+//   entry   per level: u32 rate, u16 channels, u16 bits, u32 frames,
+//           u32 FNV-1a of the original PCM bytes, u64 offset, u64 size
+//   level   bit stream of PACKED_BLOCK_FRAMES-frame blocks. A stereo
+//           block starts with one bit choosing left/right or left/side
+//           (side = left - right, one bit wider). Each channel then has a
+//           3-bit fixed predictor order, `order` warm-up samples of full
+//           width, and Rice-coded residuals in PACKED_PARTITION-sample
+//           partitions, each with its own 5-bit parameter.
+//
+// All integers are little-endian; the bit streams are MSB first.
+struct bit_writer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint64_t acc;
+    int count;
+    bool failed;
+};
 
-    while ((opt = getopt_long(argc, argv, "li:dhvm:M:b:ns:", long_options, NULL)) != -1) {
-        switch (opt) {
-            case 'l':
-                list_requested = true;
-                break;
-            case 'i':
-                device_path = optarg;
+struct bit_reader {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint64_t acc;
+    int count;
+    bool failed;
+};
+
+static inline uint32_t bit_mask(int n) {
+    return n >= 32 ? 0xffffffffu : (1u << n) - 1;
+}
+
+static void bits_put(struct bit_writer *w, uint32_t value, int n) {
+    if (n == 0) return;
+    w->acc = (w->acc << n) | (value & bit_mask(n));
+    w->count += n;
+    while (w->count >= 8) {
+        if (w->size == w->capacity) {
+            size_t capacity = w->capacity ? w->capacity * 2 : 65536;
+            uint8_t *data = realloc(w->data, capacity);
+            if (!data) {
+                w->failed = true;
+                w->count = 0;
+                return;
+            }
+            w->data = data;
+            w->capacity = capacity;
+        }
+        w->count -= 8;
+        w->data[w->size++] = (uint8_t)(w->acc >> w->count);
+    }
+}
+
+static void bits_flush(struct bit_writer *w) {
+    if (w->count > 0) bits_put(w, 0, 8 - w->count);
+}
+
+// Tops the accumulator up to at least 57 bits, a whole word at a time
+// away from the end of the stream.
+static void bits_refill(struct bit_reader *r) {
+    if (r->pos + 8 <= r->size) {
+        int bytes = (63 - r->count) >> 3;
+        uint64_t word = __builtin_bswap64(*(const uint64_t __attribute__((aligned(1), may_alias)) *)(r->data + r->pos));
+        r->acc = (r->acc << (bytes * 8)) | (word >> (64 - bytes * 8));
+        r->count += bytes * 8;
+        r->pos += bytes;
+        return;
+    }
+    while (r->count <= 56) {
+        uint8_t byte = 0;
+        if (r->pos < r->size) {
+            byte = r->data[r->pos];
+        } else if (r->pos > r->size + 8) {
+            r->failed = true;
+        }
+        r->pos++;
+        r->acc = (r->acc << 8) | byte;
+        r->count += 8;
+    }
+}
+
+static inline uint32_t bits_get(struct bit_reader *r, int n) {
+    if (n == 0) return 0;
+    if (r->count < n) bits_refill(r);
+    r->count -= n;
+    return (uint32_t)(r->acc >> r->count) & bit_mask(n);
+}
+
+static inline void rice_put(struct bit_writer *w, uint32_t value, int k) {
+    uint32_t q = value >> k;
+    if (q >= PACKED_RICE_ESCAPE) {
+        bits_put(w, 1, PACKED_RICE_ESCAPE + 1);
+        bits_put(w, value, 32);
+        return;
+    }
+    bits_put(w, 1, (int)q + 1);
+    bits_put(w, value, k);
+}
+
+static inline uint32_t rice_get(struct bit_reader *r, int k) {
+    if (r->count <= PACKED_RICE_ESCAPE) bits_refill(r);
+    uint64_t window = r->acc << (64 - r->count);
+    int q = window ? __builtin_clzll(window) : 64;
+    if (q > PACKED_RICE_ESCAPE) {
+        r->failed = true;
+        return 0;
+    }
+    r->count -= q + 1;
+    if (q == PACKED_RICE_ESCAPE) return bits_get(r, 32);
+    if (r->count < k) bits_refill(r);
+    r->count -= k;
+    return ((uint32_t)q << k) | ((uint32_t)(r->acc >> r->count) & bit_mask(k));
+}
+
+static inline uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t u) {
+    return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+// Fixed polynomial predictors of orders 0 to PACKED_MAX_ORDER.
+static inline int64_t fixed_predict(const int32_t *x, size_t i, int order) {
+    switch (order) {
+        case 1: return x[i - 1];
+        case 2: return 2 * (int64_t)x[i - 1] - x[i - 2];
+        case 3: return 3 * (int64_t)x[i - 1] - 3 * (int64_t)x[i - 2] + x[i - 3];
+        case 4: return 4 * (int64_t)x[i - 1] - 6 * (int64_t)x[i - 2] + 4 * (int64_t)x[i - 3] - x[i - 4];
+        default: return 0;
+    }
+}
+
+static uint64_t residual_cost(const int32_t *x, size_t n, int order) {
+    uint64_t sum = 0;
+    for (size_t i = (size_t)order; i < n; i++) {
+        int64_t r = x[i] - fixed_predict(x, i, order);
+        sum += (uint64_t)(r < 0 ? -r : r);
+    }
+    return sum;
+}
+
+static void pack_channel(struct bit_writer *w, const int32_t *x, size_t n, int bits) {
+    int order = 0;
+    uint64_t best = UINT64_MAX;
+    for (int o = 0; o <= PACKED_MAX_ORDER && (size_t)o < n; o++) {
+        uint64_t cost = residual_cost(x, n, o);
+        if (cost < best) {
+            best = cost;
+            order = o;
+        }
+    }
+
+    bits_put(w, (uint32_t)order, 3);
+    for (int i = 0; i < order; i++) bits_put(w, (uint32_t)x[i], bits);
+
+    for (size_t start = 0; start < n; start += PACKED_PARTITION) {
+        size_t from = start < (size_t)order ? (size_t)order : start;
+        size_t to = start + PACKED_PARTITION < n ? start + PACKED_PARTITION : n;
+        uint64_t sum = 0;
+        for (size_t i = from; i < to; i++) {
+            sum += zigzag((int32_t)(x[i] - fixed_predict(x, i, order)));
+        }
+        int k = 0;
+        while (k < 30 && ((uint64_t)(to - from) << (k + 1)) < sum) k++;
+        bits_put(w, (uint32_t)k, 5);
+        for (size_t i = from; i < to; i++) {
+            rice_put(w, zigzag((int32_t)(x[i] - fixed_predict(x, i, order))), k);
+        }
+    }
+}
+
+static bool unpack_channel(struct bit_reader *r, int32_t *x, size_t n, int bits) {
+    int order = (int)bits_get(r, 3);
+    if (order > PACKED_MAX_ORDER || (size_t)order > n) return false;
+    for (int i = 0; i < order; i++) {
+        uint32_t raw = bits_get(r, bits);
+        x[i] = (int32_t)(raw << (32 - bits)) >> (32 - bits);
+    }
+
+    for (size_t start = 0; start < n; start += PACKED_PARTITION) {
+        size_t from = start < (size_t)order ? (size_t)order : start;
+        size_t to = start + PACKED_PARTITION < n ? start + PACKED_PARTITION : n;
+        int k = (int)bits_get(r, 5);
+        // One loop per order, so the predictor is not re-dispatched per sample.
+        switch (order) {
+            case 0:
+                for (size_t i = from; i < to; i++) x[i] = unzigzag(rice_get(r, k));
+                break;
+            case 1:
+                for (size_t i = from; i < to; i++) x[i] = (int32_t)(fixed_predict(x, i, 1) + unzigzag(rice_get(r, k)));
+                break;
+            case 2:
+                for (size_t i = from; i < to; i++) x[i] = (int32_t)(fixed_predict(x, i, 2) + unzigzag(rice_get(r, k)));
+                break;
+            case 3:
+                for (size_t i = from; i < to; i++) x[i] = (int32_t)(fixed_predict(x, i, 3) + unzigzag(rice_get(r, k)));
+                break;
+            default:
+                for (size_t i = from; i < to; i++) x[i] = (int32_t)(fixed_predict(x, i, 4) + unzigzag(rice_get(r, k)));
+                break;
+        }
+        if (r->failed) return false;
+    }
+    return true;
+}
+
+static inline int32_t pcm_to_int(const uint8_t *p, int bits) {
+    switch (bits) {
+        case 8:  return (int32_t)p[0] - 128;
+        case 16: return (int16_t)read_le16(p);
+        default: return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+    }
+}
+
+static inline void int_to_pcm(uint8_t *p, int32_t v, int bits) {
+    if (bits == 8) {
+        p[0] = (uint8_t)(v + 128);
+        return;
+    }
+    for (int b = 0; b < bits / 8; b++) p[b] = (uint8_t)((uint32_t)v >> (8 * b));
+}
+
+static uint32_t fnv1a(const uint8_t *p, size_t n) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < n; i++) hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+// Encodes one level's PCM into the writer, block by block.
+static bool pack_pcm(struct bit_writer *w, const struct wav_data *wav) {
+    int channels = wav->channels, bits = wav->bits, width = bits / 8;
+    int32_t *block = malloc((size_t)channels * PACKED_BLOCK_FRAMES * sizeof(int32_t));
+    if (!block) return false;
+
+    for (size_t first = 0; first < wav->frames; first += PACKED_BLOCK_FRAMES) {
+        size_t n = wav->frames - first < PACKED_BLOCK_FRAMES ? wav->frames - first : PACKED_BLOCK_FRAMES;
+        for (int c = 0; c < channels; c++) {
+            for (size_t i = 0; i < n; i++) {
+                block[c * PACKED_BLOCK_FRAMES + i] =
+                    pcm_to_int(wav->pcm + ((first + i) * channels + c) * width, bits);
+            }
+        }
+
+        int side_bits = bits;
+        if (channels == 2) {
+            int32_t *left = block, *right = block + PACKED_BLOCK_FRAMES;
+            uint64_t independent = residual_cost(left, n, 2) + residual_cost(right, n, 2);
+            for (size_t i = 0; i < n; i++) right[i] = left[i] - right[i];
+            bool use_side = residual_cost(left, n, 2) + residual_cost(right, n, 2) < independent;
+            if (use_side) {
+                side_bits = bits + 1;
+            } else {
+                for (size_t i = 0; i < n; i++) right[i] = left[i] - right[i];
+            }
+            bits_put(w, use_side, 1);
+        }
+        for (int c = 0; c < channels; c++) {
+            pack_channel(w, block + c * PACKED_BLOCK_FRAMES, n, c == 1 ? side_bits : bits);
+        }
+    }
+    bits_flush(w);
+    free(block);
+    return !w->failed;
+}
+
+// Decodes one level into interleaved PCM, in the layout of its WAV file.
+static bool unpack_pcm(const uint8_t *data, size_t size, uint8_t *pcm, size_t frames, int channels, int bits) {
+    struct bit_reader r = { .data = data, .size = size };
+    int width = bits / 8;
+    int32_t *block = malloc((size_t)channels * PACKED_BLOCK_FRAMES * sizeof(int32_t));
+    if (!block) return false;
+
+    bool ok = true;
+    for (size_t first = 0; ok && first < frames; first += PACKED_BLOCK_FRAMES) {
+        size_t n = frames - first < PACKED_BLOCK_FRAMES ? frames - first : PACKED_BLOCK_FRAMES;
+        bool use_side = channels == 2 && bits_get(&r, 1);
+        for (int c = 0; ok && c < channels; c++) {
+            ok = unpack_channel(&r, block + c * PACKED_BLOCK_FRAMES, n, c == 1 && use_side ? bits + 1 : bits);
+        }
+        if (!ok) break;
+        if (use_side) {
+            int32_t *left = block, *right = block + PACKED_BLOCK_FRAMES;
+            for (size_t i = 0; i < n; i++) right[i] = left[i] - right[i];
+        }
+        for (int c = 0; c < channels; c++) {
+            for (size_t i = 0; i < n; i++) {
+                int_to_pcm(pcm + ((first + i) * channels + c) * width, block[c * PACKED_BLOCK_FRAMES + i], bits);
+            }
+        }
+    }
+    free(block);
+    return ok && !r.failed;
+}
+
+struct packed_entry {
+    uint32_t rate;
+    int channels;
+    int bits;
+    uint32_t frames;
+    uint32_t checksum;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static void packed_entry_read(const uint8_t *p, struct packed_entry *e) {
+    e->rate = read_le32(p);
+    e->channels = read_le16(p + 4);
+    e->bits = read_le16(p + 6);
+    e->frames = read_le32(p + 8);
+    e->checksum = read_le32(p + 12);
+    e->offset = read_le32(p + 16) | ((uint64_t)read_le32(p + 20) << 32);
+    e->size = read_le32(p + 24) | ((uint64_t)read_le32(p + 28) << 32);
+}
+
+static void packed_entry_write(uint8_t *p, const struct packed_entry *e) {
+    uint32_t words[8] = {
+        e->rate, (uint32_t)e->channels | ((uint32_t)e->bits << 16), e->frames, e->checksum,
+        (uint32_t)e->offset, (uint32_t)(e->offset >> 32), (uint32_t)e->size, (uint32_t)(e->size >> 32),
+    };
+    for (int i = 0; i < 8; i++) {
+        for (int b = 0; b < 4; b++) p[4 * i + b] = (uint8_t)(words[i] >> (8 * b));
+    }
+}
+
+// Maps the packed bank at path, checking its header. Returns false (with
+// the mapping cleared) when it is missing or not a packed bank.
+static bool packed_bank_map(const char *path, bool report) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < PACKED_HEADER_BYTES + NUM_INTENSITY_LEVELS * PACKED_ENTRY_BYTES) {
+        if (report) fprintf(stderr, "Error: %s is too short to be a packed bank\n", path);
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        if (report) fprintf(stderr, "Error: Cannot map %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (memcmp(data, PACKED_MAGIC, 8) != 0 || read_le32((const uint8_t *)data + 8) != NUM_INTENSITY_LEVELS) {
+        if (report) fprintf(stderr, "Error: %s is not a packed sound bank\n", path);
+        munmap(data, (size_t)st.st_size);
+        return false;
+    }
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+    packed_data = data;
+    packed_size = (size_t)st.st_size;
+    return true;
+}
+
+static void packed_bank_unmap(void) {
+    if (packed_data) munmap((void *)packed_data, packed_size);
+    packed_data = NULL;
+    packed_size = 0;
+}
+
+// Checks that the packed bank at path holds every level that will play.
+bool validate_packed_bank(const char *path) {
+    if (!packed_bank_map(path, true)) return false;
+
+    bool missing_levels = false;
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        if (clip_source[level] != level) continue;
+        struct packed_entry e;
+        packed_entry_read(packed_data + PACKED_HEADER_BYTES + (level - 1) * PACKED_ENTRY_BYTES, &e);
+        if (e.frames == 0) {
+            fprintf(stderr, "Error: Level %d is missing from %s\n", level, path);
+            missing_levels = true;
+        }
+    }
+    packed_bank_unmap();
+    return !missing_levels;
+}
+
+// Decodes one level of the mapped packed bank into a clip.
+static bool load_packed_level(int level, struct sample_clip *clip) {
+    struct packed_entry e;
+    packed_entry_read(packed_data + PACKED_HEADER_BYTES + (level - 1) * PACKED_ENTRY_BYTES, &e);
+    if (e.frames == 0) {
+        fprintf(stderr, "Error: Level %d is missing from the packed bank\n", level);
+        return false;
+    }
+    if (e.offset > packed_size || e.size > packed_size - e.offset || e.rate == 0 || e.channels < 1 ||
+        (e.bits != 8 && e.bits != 16 && e.bits != 24)) {
+        fprintf(stderr, "Error: Level %d of the packed bank has a corrupt header\n", level);
+        return false;
+    }
+
+    size_t pcm_bytes = (size_t)e.frames * e.channels * (e.bits / 8);
+    uint8_t *pcm = malloc(pcm_bytes);
+    if (!pcm) {
+        fprintf(stderr, "Error: Out of memory unpacking level %d\n", level);
+        return false;
+    }
+    if (!unpack_pcm(packed_data + e.offset, e.size, pcm, e.frames, e.channels, e.bits) ||
+        fnv1a(pcm, pcm_bytes) != e.checksum) {
+        fprintf(stderr, "Error: Level %d of the packed bank is corrupt\n", level);
+        free(pcm);
+        return false;
+    }
+
+    struct wav_data wav = {
+        .pcm = pcm, .frames = e.frames, .rate = e.rate, .format = 1, .bits = e.bits, .channels = e.channels,
+    };
+    char name[64];
+    snprintf(name, sizeof(name), "level %d of %s", level, PACKED_BANK_NAME);
+    bool loaded = clip_from_pcm(name, &wav, clip);
+    free(pcm);
+    atomic_fetch_add(&bank_stats.packed_bytes, (long)e.size);
+    atomic_fetch_add(&bank_stats.pcm_bytes, (long)pcm_bytes);
+    return loaded;
+}
+
+// Packs the wav files of dir_path into out_path, checking that every
+// level decodes back to the original samples.
+int pack_sound_bank(const char *dir_path, const char *out_path) {
+    uint8_t header[PACKED_HEADER_BYTES + NUM_INTENSITY_LEVELS * PACKED_ENTRY_BYTES] = {0};
+    struct bit_writer w = {0};
+    size_t total_pcm = 0;
+    char path[PATH_MAX];
+
+    memcpy(header, PACKED_MAGIC, 8);
+    header[8] = NUM_INTENSITY_LEVELS;
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        snprintf(path, sizeof(path), "%s/%d.wav", dir_path, level);
+        struct wav_data wav;
+        if (!read_wav(path, &wav)) {
+            free(w.data);
+            return 1;
+        }
+        if (wav.format != 1 || wav.bits > 24) {
+            fprintf(stderr, "Error: %s: only 8, 16 and 24-bit PCM can be packed\n", path);
+            free(wav.data);
+            free(w.data);
+            return 1;
+        }
+
+        size_t pcm_bytes = wav.frames * wav.channels * (wav.bits / 8);
+        struct packed_entry e = {
+            .rate = wav.rate, .channels = wav.channels, .bits = wav.bits, .frames = (uint32_t)wav.frames,
+            .checksum = fnv1a(wav.pcm, pcm_bytes), .offset = sizeof(header) + w.size,
+        };
+        if (!pack_pcm(&w, &wav)) {
+            fprintf(stderr, "Error: Out of memory packing %s\n", path);
+            free(wav.data);
+            free(w.data);
+            return 1;
+        }
+        e.size = sizeof(header) + w.size - e.offset;
+
+        uint8_t *check = malloc(pcm_bytes);
+        bool lossless = check && unpack_pcm(w.data + (e.offset - sizeof(header)), e.size, check,
+                                            e.frames, e.channels, e.bits) &&
+                        memcmp(check, wav.pcm, pcm_bytes) == 0;
+        free(check);
+        free(wav.data);
+        if (!lossless) {
+            fprintf(stderr, "Error: Level %d did not survive a round trip\n", level);
+            free(w.data);
+            return 1;
+        }
+
+        packed_entry_write(header + PACKED_HEADER_BYTES + (level - 1) * PACKED_ENTRY_BYTES, &e);
+        total_pcm += pcm_bytes;
+        printf("Level %2d: %zu bytes of %d-bit PCM packed into %zu (%.1f%%)\n",
+               level, pcm_bytes, e.bits, (size_t)e.size, 100.0 * e.size / pcm_bytes);
+    }
+
+    FILE *f = fopen(out_path, "wb");
+    bool written = f && fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+                   fwrite(w.data, 1, w.size, f) == w.size;
+    if (f && fclose(f) != 0) written = false;
+    free(w.data);
+    if (!written) {
+        fprintf(stderr, "Error: Failed to write %s: %s\n", out_path, strerror(errno));
+        return 1;
+    }
+    printf("Packed bank written to %s: %zu bytes for %zu bytes of PCM (%.1f%%)\n",
+           out_path, sizeof(header) + w.size, total_pcm, 100.0 * (sizeof(header) + w.size) / total_pcm);
+    return 0;
+}
+
+// Prints a debug line stamped with the time since startup, so the order
+// in which the backend, loaders, render thread and reader come up is visible.
+void startup_mark(const char *fmt, ...) {
+    if (!debug.enabled) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    printf("DEBUG: [startup +%.1f ms] %s\n", timespec_diff_us(&now, &startup_time) / 1000.0, line);
+}
+
+// Picks the next queued level, levels somebody is waiting for first.
+// Called with loader_mutex held.
+static int next_queued_level(void) {
+    int fallback = 0;
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        if (atomic_load(&bank_state[level]) != LEVEL_QUEUED) continue;
+        if (bank_urgent[level]) return level;
+        if (!fallback) fallback = level;
+    }
+    return fallback;
+}
+
+// Loader worker: claims queued levels one at a time. Levels vary a lot in
+// length, so claiming beats a static split. Eager workers exit once the
+// queue is empty; lazy ones block until the next request.
+static void *bank_loader_thread(void *arg) {
+    (void)arg;
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&loader_mutex);
+    while (!bank_cancel) {
+        int level = next_queued_level();
+        if (!level) {
+            if (!lazy_bank) break;
+            pthread_cond_wait(&loader_cond, &loader_mutex);
+            continue;
+        }
+        atomic_store(&bank_state[level], LEVEL_LOADING);
+        pthread_mutex_unlock(&loader_mutex);
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        snprintf(path, sizeof(path), "%s/%d.wav", bank_directory, level);
+        struct sample_clip clip = {0};
+        if (packed_data ? load_packed_level(level, &clip) : load_wav_file(path, &clip)) {
+            bank[level] = clip;
+            atomic_fetch_add(&bank_stats.mapped_bytes, (long)clip.mapped_bytes);
+            atomic_fetch_add(&bank_stats.locked_clips, clip.locked);
+            atomic_store_explicit(&bank_state[level], LEVEL_READY, memory_order_release);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            startup_mark("Level %d ready (%zu frames, %.1f ms%s)", level, clip.length,
+                         timespec_diff_us(&end, &begin) / 1000.0,
+                         atomic_load(&bank_prefetched[level]) ? ", prefetched" : "");
+        } else {
+            atomic_store(&bank_state[level], LEVEL_FAILED);
+            fprintf(stderr, "Error: Intensity level %d stays silent\n", level);
+        }
+        if (atomic_fetch_add(&bank_levels_done, 1) + 1 == bank_levels_total) {
+            startup_mark("Sound bank complete");
+        }
+
+        pthread_mutex_lock(&loader_mutex);
+    }
+    pthread_mutex_unlock(&loader_mutex);
+    return NULL;
+}
+
+// Queues a level that is not loaded yet. An urgent request (a trigger is
+// waiting for the level) moves it ahead of prefetches.
+static void bank_request(int level, bool urgent) {
+    int state = atomic_load_explicit(&bank_state[level], memory_order_relaxed);
+    if (state != LEVEL_EMPTY && (state != LEVEL_QUEUED || !urgent)) return;
+
+    pthread_mutex_lock(&loader_mutex);
+    state = atomic_load(&bank_state[level]);
+    if (state == LEVEL_EMPTY) {
+        atomic_store(&bank_state[level], LEVEL_QUEUED);
+        bank_urgent[level] = urgent;
+        if (!urgent) {
+            atomic_store(&bank_prefetched[level], true);
+            atomic_fetch_add(&bank_stats.prefetches, 1);
+        }
+        pthread_cond_signal(&loader_cond);
+    } else if (state == LEVEL_QUEUED) {
+        bank_urgent[level] = true;
+    }
+    pthread_mutex_unlock(&loader_mutex);
+}
+
+// Called by the reader for every trigger in lazy mode. While the intensity
+// is rising within the current window, the next levels up are prefetched
+// so the peak of a movement does not wait for its sound to decode.
+static void bank_follow_trend(int level, const struct timespec *time) {
+    if (timespec_diff_us(time, &trend_window_start) >= TREND_WINDOW_MS * 1000L) {
+        trend_reference = level;
+        trend_window_start = *time;
+        return;
+    }
+    if (level <= trend_reference) return;
+
+    for (int ahead = 1; ahead <= PREFETCH_AHEAD && level + ahead <= NUM_INTENSITY_LEVELS; ahead++) {
+        bank_request(clip_source[level + ahead], false);
+    }
+}
+
+// Starts the loader pool, up to one worker per available CPU. Eagerly all
+// levels are queued right away. Returns false only if no worker could be
+// started.
+bool load_sound_bank(const char *dir_path) {
+    cpu_set_t cpus;
+    int workers = 1;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        workers = CPU_COUNT(&cpus);
+    }
+    if (workers > MAX_LOADER_THREADS) workers = MAX_LOADER_THREADS;
+    if (workers > bank_levels_total) workers = bank_levels_total;
+    if (workers < 1) workers = 1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, PACKED_BANK_NAME);
+    if (access(path, F_OK) == 0) {
+        if (!packed_bank_map(path, true)) return false;
+        startup_mark("Unpacking %s (%zu bytes)", path, packed_size);
+    }
+
+    bank_directory = dir_path;
+    bank_cancel = false;
+    bank_rate_fixed = true;
+    atomic_store(&bank_levels_done, 0);
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        bool queued = !lazy_bank && clip_source[level] == level;
+        atomic_store(&bank_state[level], queued ? LEVEL_QUEUED : LEVEL_EMPTY);
+        bank_urgent[level] = false;
+        atomic_store(&bank_prefetched[level], false);
+    }
+
+    startup_mark("%s %d levels on %d worker(s)", lazy_bank ? "Lazily loading" : "Loading",
+                 bank_levels_total, workers);
+    for (loader_threads = 0; loader_threads < workers; loader_threads++) {
+        int err = pthread_create(&loader_thread_ids[loader_threads], NULL, bank_loader_thread, NULL);
+        if (err != 0) {
+            fprintf(stderr, "Error: Failed to create loader thread: %s\n", strerror(err));
+            break;
+        }
+    }
+    return loader_threads > 0;
+}
+
+void wait_sound_bank(void) {
+    pthread_mutex_lock(&loader_mutex);
+    bank_cancel = true;
+    pthread_cond_broadcast(&loader_cond);
+    pthread_mutex_unlock(&loader_mutex);
+
+    for (int i = 0; i < loader_threads; i++) {
+        pthread_join(loader_thread_ids[i], NULL);
+    }
+    loader_threads = 0;
+}
+
+// Maps memory for one clip. With explicit huge pages the size is rounded
+// up to whole 2 MB pages, falling back to normal pages when the hugetlb
+// pool is empty. With --lock-bank the pages are faulted in and locked now,
+// so the render thread never takes a page fault on them; if the memlock
+// limit is too small they are at least touched.
+float *bank_alloc(size_t bytes, struct sample_clip *clip) {
+    size_t size = bytes > 0 ? bytes : 1;
+    void *p = MAP_FAILED;
+
+    static atomic_bool huge_pages_failed;
+    if (strcmp(huge_pages, "explicit") == 0 && !atomic_load(&huge_pages_failed)) {
+        size_t rounded = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            size = rounded;
+        } else if (!atomic_exchange(&huge_pages_failed, true)) {
+            if (debug.enabled) {
+                printf("DEBUG: Explicit huge pages unavailable (%s), using normal pages\n", strerror(errno));
+            }
+        }
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return NULL;
+        if (strcmp(huge_pages, "thp") == 0) {
+            madvise(p, size, MADV_HUGEPAGE);
+        }
+    }
+
+    clip->mapped_bytes = size;
+    clip->locked = false;
+    if (lock_bank) {
+        if (mlock(p, size) == 0) {
+            clip->locked = true;
+        } else {
+            static atomic_bool warned;
+            if (!atomic_exchange(&warned, true)) {
+                fprintf(stderr, "Warning: Cannot lock sound bank in memory: %s\n", strerror(errno));
+            }
+            long page = sysconf(_SC_PAGESIZE);
+            for (size_t off = 0; off < size; off += (size_t)page) {
+                ((volatile uint8_t *)p)[off] = 0;
+            }
+        }
+    }
+    return p;
+}
+
+void free_sound_bank(void) {
+    packed_bank_unmap();
+    for (int i = 1; i <= NUM_INTENSITY_LEVELS; i++) {
+        atomic_store(&bank_state[i], LEVEL_EMPTY);
+        if (bank[i].planes[0]) munmap(bank[i].planes[0], bank[i].mapped_bytes);
+        memset(bank[i].planes, 0, sizeof(bank[i].planes));
+        bank[i].length = 0;
+        bank[i].mapped_bytes = 0;
+    }
+}
+
+static pid_t aplay_pid = -1;
+static int aplay_fd = -1;
+static int aplay_err_fd = -1;
+static long aplay_xrun_count = 0;
+
+// Starts aplay playing raw frames at sample_rate from the returned pipe
+// on device, or the default one. A period size asks for a low-latency
+// stream: the pipe is cut to a page and the sizes are passed on; without
+// one aplay picks its own. With err_fd, aplay's stderr can be read there;
+// otherwise it shares ours. Returns the child's pid, or -1.
+static pid_t aplay_spawn(const char *device, int period, int buffer, int *fd, int *err_fd) {
+    int fds[2], err_fds[2] = {-1, -1};
+    if (pipe(fds) != 0) {
+        perror("Failed to create aplay pipe");
+        return -1;
+    }
+    if (err_fd && pipe2(err_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("Failed to create aplay pipe");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (period > 0) fcntl(fds[1], F_SETPIPE_SZ, 4096);
+
+    char rate_arg[32], period_arg[32], buffer_arg[32];
+    snprintf(rate_arg, sizeof(rate_arg), "%d", sample_rate);
+    snprintf(period_arg, sizeof(period_arg), "--period-size=%d", period);
+    snprintf(buffer_arg, sizeof(buffer_arg), "--buffer-size=%d", buffer);
+
+    const char *argv[16];
+    int argc = 0;
+    argv[argc++] = "aplay";
+    argv[argc++] = "-q";
+    argv[argc++] = "-t";
+    argv[argc++] = "raw";
+    argv[argc++] = "-f";
+    argv[argc++] = "S16_LE";
+    argv[argc++] = "-c";
+    argv[argc++] = "2";
+    argv[argc++] = "-r";
+    argv[argc++] = rate_arg;
+    if (period > 0) {
+        argv[argc++] = period_arg;
+        argv[argc++] = buffer_arg;
+    }
+    if (device) {
+        argv[argc++] = "-D";
+        argv[argc++] = device;
+    }
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to start aplay");
+        close(fds[0]);
+        close(fds[1]);
+        if (err_fd) {
+            close(err_fds[0]);
+            close(err_fds[1]);
+        }
+        return -1;
+    }
+    if (pid == 0) {
+        // dup2 clears close-on-exec on the copies.
+        dup2(fds[0], STDIN_FILENO);
+        if (err_fd) dup2(err_fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp("aplay", (char *const *)argv);
+        _exit(127);
+    }
+
+    close(fds[0]);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    *fd = fds[1];
+    if (err_fd) {
+        close(err_fds[1]);
+        *err_fd = err_fds[0];
+    }
+    return pid;
+}
+
+// Streams raw PCM into a single long-lived aplay process. The pipe is
+// shrunk to its minimum so it adds as little buffering as possible on
+// top of aplay's own period and buffer sizes.
+static bool aplay_open(void) {
+    aplay_pid = aplay_spawn(audio_device, period_frames, buffer_frames, &aplay_fd, &aplay_err_fd);
+    return aplay_pid > 0;
+}
+
+static bool aplay_write(const int16_t *frames, size_t count) {
+    const uint8_t *p = (const uint8_t *)frames;
+    size_t remaining = count * ENGINE_CHANNELS * sizeof(int16_t);
+    while (remaining > 0) {
+        ssize_t n = write(aplay_fd, p, remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        remaining -= (size_t)n;
+    }
+    return true;
+}
+
+// The pipe contents plus aplay's own device buffer, which is assumed full
+// while the render thread keeps the pipe fed.
+static long aplay_delay(void) {
+    int queued = 0;
+    if (ioctl(aplay_fd, FIONREAD, &queued) < 0) return -1;
+    return queued / (long)(ENGINE_CHANNELS * sizeof(int16_t)) + buffer_frames;
+}
+
+// aplay reports every underrun on stderr as "underrun!!! (at least N ms
+// long)"; the lines are counted without ever blocking on the pipe.
+static long aplay_xruns(void) {
+    static char line[128];
+    static size_t line_len = 0;
+    char chunk[512];
+    ssize_t n;
+
+    while (aplay_err_fd >= 0 && (n = read(aplay_err_fd, chunk, sizeof(chunk))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (chunk[i] != '\n') {
+                if (line_len < sizeof(line) - 1) line[line_len++] = chunk[i];
+                continue;
+            }
+            line[line_len] = '\0';
+            if (strstr(line, "underrun")) {
+                aplay_xrun_count++;
+            } else if (debug.enabled && line_len > 0) {
+                printf("DEBUG: aplay: %s\n", line);
+            }
+            line_len = 0;
+        }
+    }
+    return aplay_xrun_count;
+}
+
+static void aplay_close(void) {
+    if (aplay_fd >= 0) {
+        close(aplay_fd);
+        aplay_fd = -1;
+    }
+    if (aplay_err_fd >= 0) {
+        aplay_xruns();
+        close(aplay_err_fd);
+        aplay_err_fd = -1;
+    }
+    if (aplay_pid > 0) {
+        waitpid(aplay_pid, NULL, 0);
+        aplay_pid = -1;
+    }
+}
+
+// aplay has no way to pause its device, and starving it only forces an
+// underrun. Idle closes the pipe instead, so aplay drains what is queued
+// and exits, releasing the device; resuming starts a new aplay. If that
+// fails, the next write fails and the output is recovered as usual.
+static void aplay_pause(bool paused) {
+    if (paused) {
+        aplay_close();
+    } else {
+        aplay_open();
+    }
+}
+
+static struct timespec null_deadline;
+
+static bool null_open(void) {
+    clock_gettime(CLOCK_MONOTONIC, &null_deadline);
+    return true;
+}
+
+// Discards audio at the rate a real device would consume it.
+static bool null_write(const int16_t *frames, size_t count) {
+    (void)frames;
+    null_deadline.tv_nsec += (long)(count * 1000000000LL / sample_rate);
+    while (null_deadline.tv_nsec >= 1000000000L) {
+        null_deadline.tv_nsec -= 1000000000L;
+        null_deadline.tv_sec++;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &null_deadline, NULL) == EINTR) {
+    }
+    return true;
+}
+
+// The rest of the period last written, which is still "playing".
+static long null_delay(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long us = timespec_diff_us(&null_deadline, &now);
+    return us > 0 ? us * sample_rate / 1000000L : 0;
+}
+
+static void null_pause(bool paused) {
+    if (!paused) clock_gettime(CLOCK_MONOTONIC, &null_deadline);
+}
+
+static void null_close(void) {
+}
+
+#ifdef SUPERMOAN_ALSA
+static snd_pcm_t *alsa_pcm = NULL;
+static long alsa_xrun_count = 0;
+
+// Opens the device with period_frames/buffer_frames as the requested
+// sizes and writes back what the hardware actually granted.
+static bool alsa_open(void) {
+    const char *name = audio_device ? audio_device : "default";
+    int err = snd_pcm_open(&alsa_pcm, name, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) {
+        fprintf(stderr, "Error: Cannot open ALSA device %s: %s\n", name, snd_strerror(err));
+        alsa_pcm = NULL;
+        return false;
+    }
+
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_hw_params_any(alsa_pcm, hw);
+    unsigned int rate = (unsigned int)sample_rate;
+    snd_pcm_uframes_t period = (snd_pcm_uframes_t)period_frames;
+    snd_pcm_uframes_t buffer = (snd_pcm_uframes_t)buffer_frames;
+    if ((err = snd_pcm_hw_params_set_access(alsa_pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(alsa_pcm, hw, SND_PCM_FORMAT_S16_LE)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(alsa_pcm, hw, ENGINE_CHANNELS)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near(alsa_pcm, hw, &rate, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(alsa_pcm, hw, &period, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_buffer_size_near(alsa_pcm, hw, &buffer)) < 0 ||
+        (err = snd_pcm_hw_params(alsa_pcm, hw)) < 0) {
+        fprintf(stderr, "Error: Cannot configure ALSA device %s: %s\n", name, snd_strerror(err));
+        snd_pcm_close(alsa_pcm);
+        alsa_pcm = NULL;
+        return false;
+    }
+    snd_pcm_hw_params_get_period_size(hw, &period, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &buffer);
+
+    if ((int)rate != sample_rate && bank_rate_fixed) {
+        fprintf(stderr, "Warning: ALSA device %s now runs at %u Hz, resampling the sound bank\n", name, rate);
+    }
+    sample_rate = (int)rate;
+    period_frames = period > MAX_PERIOD_FRAMES ? MAX_PERIOD_FRAMES : (int)period;
+    buffer_frames = (int)buffer;
+
+    // Start as soon as one period is queued; wake when one period is free.
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(alsa_pcm, sw);
+    snd_pcm_sw_params_set_start_threshold(alsa_pcm, sw, period);
+    snd_pcm_sw_params_set_avail_min(alsa_pcm, sw, period);
+    snd_pcm_sw_params(alsa_pcm, sw);
+
+    if (debug.enabled) {
+        printf("DEBUG: ALSA %s: %d Hz, period %d, buffer %d frames\n",
+               name, sample_rate, period_frames, buffer_frames);
+    }
+    return true;
+}
+
+// Underruns are recovered in place and counted; anything else (device
+// unplugged, suspended beyond resume) is reported as an output failure.
+static bool alsa_write(const int16_t *frames, size_t count) {
+    while (count > 0) {
+        snd_pcm_sframes_t n = snd_pcm_writei(alsa_pcm, frames, count);
+        if (n == -EPIPE) {
+            alsa_xrun_count++;
+            if (snd_pcm_prepare(alsa_pcm) < 0) return false;
+            continue;
+        }
+        if (n == -EINTR || n == -ESTRPIPE) {
+            if (snd_pcm_recover(alsa_pcm, (int)n, 1) < 0) return false;
+            continue;
+        }
+        if (n < 0) return false;
+        frames += n * ENGINE_CHANNELS;
+        count -= (size_t)n;
+    }
+    return true;
+}
+
+static long alsa_delay(void) {
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(alsa_pcm, &delay) < 0) return -1;
+    return delay;
+}
+
+// Dropping stops the hardware pointer at once, so an idle device raises
+// no interrupts; prepare() readies it for the next write.
+static void alsa_pause(bool paused) {
+    if (paused) {
+        snd_pcm_drop(alsa_pcm);
+    } else {
+        snd_pcm_prepare(alsa_pcm);
+    }
+}
+
+static void alsa_close(void) {
+    if (alsa_pcm) {
+        snd_pcm_close(alsa_pcm);
+        alsa_pcm = NULL;
+    }
+}
+
+static long alsa_xruns(void) {
+    return alsa_xrun_count;
+}
+#endif
+
+#ifdef SUPERMOAN_PIPEWIRE
+static struct pw_thread_loop *pw_loop = NULL;
+static struct pw_stream *pw_stream = NULL;
+static atomic_uint pw_quantum = 0;
+static bool pw_closing = false;
+
+// Runs in PipeWire's data thread: renders straight into the dequeued
+// buffer, sized by what the graph asks for this cycle.
+static void pipewire_process(void *userdata) {
+    (void)userdata;
+
+    struct pw_buffer *b = pw_stream_dequeue_buffer(pw_stream);
+    if (!b) return;
+
+    struct spa_data *d = &b->buffer->datas[0];
+    if (!d->data) {
+        pw_stream_queue_buffer(pw_stream, b);
+        return;
+    }
+
+    uint32_t stride = ENGINE_CHANNELS * sizeof(int16_t);
+    uint32_t frames = d->maxsize / stride;
+    if (b->requested > 0 && b->requested < frames) frames = (uint32_t)b->requested;
+    if (frames > MAX_PERIOD_FRAMES) frames = MAX_PERIOD_FRAMES;
+    atomic_store_explicit(&pw_quantum, frames, memory_order_relaxed);
+
+    engine_render_callback(d->data, frames);
+
+    d->chunk->offset = 0;
+    d->chunk->stride = (int32_t)stride;
+    d->chunk->size = frames * stride;
+    pw_stream_queue_buffer(pw_stream, b);
+}
+
+// A stream that errors out or loses its target node counts as a lost
+// device and is reopened by the render thread.
+static void pipewire_state_changed(void *userdata, enum pw_stream_state old,
+                                   enum pw_stream_state state, const char *error) {
+    (void)userdata;
+    if (pw_closing) return;
+    if (state == PW_STREAM_STATE_ERROR) {
+        fprintf(stderr, "Error: PipeWire stream failed: %s\n", error ? error : "unknown error");
+        engine_output_failed();
+    } else if (state == PW_STREAM_STATE_UNCONNECTED && old != PW_STREAM_STATE_CONNECTING) {
+        engine_output_failed();
+    } else if (debug.enabled) {
+        printf("DEBUG: PipeWire stream %s\n", pw_stream_state_as_string(state));
+    }
+}
+
+static const struct pw_stream_events pipewire_stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .state_changed = pipewire_state_changed,
+    .process = pipewire_process,
+};
+
+// Asks the graph for a quantum of period_frames at sample_rate through
+// node.latency; the quantum actually granted is whatever each process
+// cycle requests and is reported in the debug statistics.
+static bool pipewire_open(void) {
+    pw_init(NULL, NULL);
+
+    pw_loop = pw_thread_loop_new("supermoan-pw", NULL);
+    if (!pw_loop) {
+        fprintf(stderr, "Error: Failed to create PipeWire loop\n");
+        return false;
+    }
+
+    char latency[32], rate[32];
+    snprintf(latency, sizeof(latency), "%d/%d", period_frames, sample_rate);
+    snprintf(rate, sizeof(rate), "1/%d", sample_rate);
+    struct pw_properties *props = pw_properties_new(
+        PW_KEY_MEDIA_TYPE, "Audio",
+        PW_KEY_MEDIA_CATEGORY, "Playback",
+        PW_KEY_MEDIA_ROLE, "Game",
+        PW_KEY_NODE_LATENCY, latency,
+        PW_KEY_NODE_RATE, rate,
+        NULL);
+    if (audio_device) {
+        pw_properties_set(props, PW_KEY_TARGET_OBJECT, audio_device);
+    }
+
+    pw_stream = pw_stream_new_simple(pw_thread_loop_get_loop(pw_loop), "supermoan",
+                                     props, &pipewire_stream_events, NULL);
+    if (!pw_stream) {
+        fprintf(stderr, "Error: Failed to create PipeWire stream\n");
+        pw_thread_loop_destroy(pw_loop);
+        pw_loop = NULL;
+        return false;
+    }
+
+    uint8_t pod_buffer[1024];
+    struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+    const struct spa_pod *params[1];
+    params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat,
+        &SPA_AUDIO_INFO_RAW_INIT(.format = SPA_AUDIO_FORMAT_S16,
+                                 .channels = ENGINE_CHANNELS,
+                                 .rate = (uint32_t)sample_rate));
+
+    int err = pw_stream_connect(pw_stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+                                PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS |
+                                PW_STREAM_FLAG_RT_PROCESS,
+                                params, 1);
+    const char *failed = "connect PipeWire stream";
+    if (err >= 0) {
+        failed = "start PipeWire thread loop";
+        err = pw_thread_loop_start(pw_loop);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Error: Failed to %s: %s\n", failed, strerror(-err));
+        pw_stream_destroy(pw_stream);
+        pw_thread_loop_destroy(pw_loop);
+        pw_stream = NULL;
+        pw_loop = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void pipewire_pause(bool paused) {
+    pw_thread_loop_lock(pw_loop);
+    pw_stream_set_active(pw_stream, !paused);
+    pw_thread_loop_unlock(pw_loop);
+}
+
+static void pipewire_close(void) {
+    pw_closing = true;
+    if (pw_loop) pw_thread_loop_stop(pw_loop);
+    if (pw_stream) pw_stream_destroy(pw_stream);
+    if (pw_loop) pw_thread_loop_destroy(pw_loop);
+    pw_stream = NULL;
+    pw_loop = NULL;
+    pw_deinit();
+    pw_closing = false;
+
+    if (debug.enabled && atomic_load(&pw_quantum) > 0) {
+        printf("DEBUG: PipeWire quantum: %u frames (requested %d)\n",
+               atomic_load(&pw_quantum), period_frames);
+    }
+}
+#endif
+
+#ifdef SUPERMOAN_JACK
+static jack_client_t *jack_client = NULL;
+static jack_port_t *jack_ports[ENGINE_CHANNELS];
+static atomic_bool jack_paused = false;
+
+// Runs in JACK's real-time thread: no locks, no allocation, no stdio and
+// no system calls.
+// The mix is rendered straight into the port buffers.
+static int jack_process(jack_nframes_t nframes, void *arg) {
+    (void)arg;
+
+    jack_default_audio_sample_t *out[ENGINE_CHANNELS];
+    for (int c = 0; c < ENGINE_CHANNELS; c++) {
+        out[c] = jack_port_get_buffer(jack_ports[c], nframes);
+    }
+
+    if (atomic_load_explicit(&jack_paused, memory_order_relaxed)) {
+        for (int c = 0; c < ENGINE_CHANNELS; c++) {
+            memset(out[c], 0, nframes * sizeof(jack_default_audio_sample_t));
+        }
+        return 0;
+    }
+
+    for (jack_nframes_t done = 0; done < nframes; ) {
+        jack_nframes_t chunk = nframes - done;
+        if (chunk > MAX_PERIOD_FRAMES) chunk = MAX_PERIOD_FRAMES;
+
+        engine_render_float_callback(out[0] + done, out[1] + done, chunk);
+        done += chunk;
+    }
+    return 0;
+}
+
+static void jack_shutdown(void *arg) {
+    (void)arg;
+    engine_output_failed();
+}
+
+// The client follows the server's rate and period; -D names the port
+// prefix to connect to (default: the physical playback ports).
+static bool jack_open(void) {
+    jack_status_t status;
+    jack_client = jack_client_open("supermoan", JackNoStartServer, &status);
+    if (!jack_client) {
+        fprintf(stderr, "Error: Cannot connect to JACK server (status 0x%x)\n", (unsigned)status);
+        return false;
+    }
+
+    // Voices resample clips converted at the old rate after a restarted
+    // server comes back at a different one.
+    int rate = (int)jack_get_sample_rate(jack_client);
+    if (bank_rate_fixed && rate != sample_rate) {
+        fprintf(stderr, "Warning: JACK rate changed from %d to %d Hz, resampling the sound bank\n", sample_rate, rate);
+    }
+    sample_rate = rate;
+    period_frames = (int)jack_get_buffer_size(jack_client);
+    if (period_frames > MAX_PERIOD_FRAMES) period_frames = MAX_PERIOD_FRAMES;
+
+    jack_set_process_callback(jack_client, jack_process, NULL);
+    jack_on_shutdown(jack_client, jack_shutdown, NULL);
+
+    for (int c = 0; c < ENGINE_CHANNELS; c++) {
+        char name[16];
+        snprintf(name, sizeof(name), "out_%d", c + 1);
+        jack_ports[c] = jack_port_register(jack_client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+        if (!jack_ports[c]) {
+            fprintf(stderr, "Error: Cannot register JACK port %s\n", name);
+            jack_client_close(jack_client);
+            jack_client = NULL;
+            return false;
+        }
+    }
+
+    if (jack_activate(jack_client) != 0) {
+        fprintf(stderr, "Error: Cannot activate JACK client\n");
+        jack_client_close(jack_client);
+        jack_client = NULL;
+        return false;
+    }
+
+    const char **targets = jack_get_ports(jack_client, audio_device, JACK_DEFAULT_AUDIO_TYPE,
+                                          JackPortIsInput | (audio_device ? 0 : JackPortIsPhysical));
+    for (int c = 0; targets && targets[c] && c < ENGINE_CHANNELS; c++) {
+        if (jack_connect(jack_client, jack_port_name(jack_ports[c]), targets[c]) != 0) {
+            fprintf(stderr, "Warning: Cannot connect %s to %s\n", jack_port_name(jack_ports[c]), targets[c]);
+        }
+    }
+    if (!targets) {
+        fprintf(stderr, "Warning: No JACK playback ports found, leaving outputs unconnected\n");
+    }
+    jack_free(targets);
+
+    if (debug.enabled) {
+        printf("DEBUG: JACK client running at %d Hz, %d frames per period\n", sample_rate, period_frames);
+    }
+    return true;
+}
+
+// The server wakes every client each period regardless, so idling only
+// skips rendering; deactivating would drop the port connections.
+static void jack_pause(bool paused) {
+    atomic_store(&jack_paused, paused);
+}
+
+static void jack_close(void) {
+    if (jack_client) {
+        jack_deactivate(jack_client);
+        jack_client_close(jack_client);
+        jack_client = NULL;
+    }
+}
+#endif
+
+static const struct output_backend output_backends[] = {
+    { "aplay", aplay_open, aplay_write, aplay_pause, aplay_close, aplay_xruns, aplay_delay },
+#ifdef SUPERMOAN_ALSA
+    { "alsa", alsa_open, alsa_write, alsa_pause, alsa_close, alsa_xruns, alsa_delay },
+#endif
+#ifdef SUPERMOAN_PIPEWIRE
+    { "pipewire", pipewire_open, NULL, pipewire_pause, pipewire_close, NULL, NULL },
+#endif
+#ifdef SUPERMOAN_JACK
+    { "jack", jack_open, NULL, jack_pause, jack_close, NULL, NULL },
+#endif
+    { "null", null_open, null_write, null_pause, null_close, NULL, null_delay },
+};
+
+const char *backend_names(void) {
+    static char names[128];
+    names[0] = '\0';
+    for (size_t i = 0; i < sizeof(output_backends) / sizeof(output_backends[0]); i++) {
+        if (i > 0) strncat(names, ", ", sizeof(names) - strlen(names) - 1);
+        strncat(names, output_backends[i].name, sizeof(names) - strlen(names) - 1);
+    }
+    return names;
+}
+
+const struct output_backend *find_backend(const char *name) {
+    for (size_t i = 0; i < sizeof(output_backends) / sizeof(output_backends[0]); i++) {
+        if (strcmp(output_backends[i].name, name) == 0) {
+            return &output_backends[i];
+        }
+    }
+    return NULL;
+}
+
+// A secondary output given with --tee. The render thread copies every
+// mixed period into the sink's ring and moves on; the sink's own thread
+// drains the ring into the file or device. A sink that cannot keep up
+// loses the periods that do not fit, one that fails is dropped, and
+// neither ever holds up the primary output.
+struct sink {
+    const char *spec;
+    const char *target;
+    const struct sink_type *type;
+    int16_t *ring;
+    size_t ring_frames;
+    atomic_size_t head;
+    atomic_size_t tail;
+    sem_t wakeup;
+    pthread_t thread;
+    bool started;
+    bool opened;
+    atomic_bool failed;
+    atomic_long frames_written;
+    atomic_long frames_dropped;
+    FILE *wav;
+    uint64_t wav_bytes;
+    uint64_t wav_patched;
+    int fd;
+    pid_t pid;
+    struct shm_ring *shm;
+    size_t shm_size;
+    size_t shm_frames;
+    uint64_t shm_head;
+    _Atomic(struct shm_ring *) shm_live;
+    atomic_bool shm_feeding;
+    int memfd;
+    int event_fd;
+    int listen_fd;
+    int stop_fd;
+#ifdef SUPERMOAN_ALSA
+    snd_pcm_t *pcm;
+#endif
+};
+
+// Most sinks are written by their thread from the ring. A sink with feed
+// takes each period straight from the render thread instead, which must
+// not block, and its serve function runs in place of the ring drainer
+// until wake() tells it to stop.
+struct sink_type {
+    const char *prefix;
+    bool (*open)(struct sink *s);
+    bool (*write)(struct sink *s, const int16_t *frames, size_t count);
+    void (*close)(struct sink *s);
+    void (*feed)(struct sink *s, const int16_t *frames, size_t count);
+    void *(*serve)(void *arg);
+    void (*wake)(struct sink *s);
+};
+
+// Shared with the consumer of a shm: sink, at the start of the memfd; the
+// frames follow at SHM_RING_HEADER. The render thread advances head, the
+// consumer tail, each on its own cache line. A consumer that finds the
+// ring empty sets waiting and blocks on the eventfd, which the render
+// thread only writes to while waiting is set. attached is set while the
+// consumer is connected and only informs it; the render thread goes by
+// the sink's own state and writes nothing without a consumer.
+struct shm_ring {
+    char magic[8];
+    uint32_t rate;
+    uint32_t channels;
+    uint32_t frames;
+    uint32_t attached;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t waiting;
+};
+
+static struct sink sinks[MAX_SINKS];
+static int sink_count = 0;
+static atomic_bool sinks_stopping;
+
+// Fills in the RIFF and data sizes for what has been written so far.
+static void wav_sink_patch(struct sink *s) {
+    uint8_t size[4];
+    uint64_t data = s->wav_bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : s->wav_bytes;
+    int fd = fileno(s->wav);
+    write_le32(size, (uint32_t)(data + 36));
+    ssize_t ignored = pwrite(fd, size, sizeof(size), 4);
+    write_le32(size, (uint32_t)data);
+    ignored = pwrite(fd, size, sizeof(size), 40);
+    (void)ignored;
+    s->wav_patched = s->wav_bytes;
+}
+
+static bool wav_sink_open(struct sink *s) {
+    s->wav = fopen(s->target, "wb");
+    if (!s->wav) {
+        fprintf(stderr, "Warning: Cannot create %s: %s\n", s->target, strerror(errno));
+        return false;
+    }
+    uint8_t header[WAV_HEADER_BYTES];
+    memcpy(header, "RIFF", 4);
+    write_le32(header + 4, 36);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    write_le32(header + 16, 16);
+    write_le16(header + 20, 1);
+    write_le16(header + 22, ENGINE_CHANNELS);
+    write_le32(header + 24, (uint32_t)sample_rate);
+    write_le32(header + 28, (uint32_t)(sample_rate * ENGINE_CHANNELS * sizeof(int16_t)));
+    write_le16(header + 32, ENGINE_CHANNELS * sizeof(int16_t));
+    write_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    write_le32(header + 40, 0);
+    s->wav_bytes = 0;
+    s->wav_patched = 0;
+    return fwrite(header, 1, sizeof(header), s->wav) == sizeof(header);
+}
+
+// The sizes are kept current about once a second, so a file cut short by
+// a crash still plays up to then; closing the sink brings them up to
+// date.
+static bool wav_sink_write(struct sink *s, const int16_t *frames, size_t count) {
+    if (fwrite(frames, ENGINE_CHANNELS * sizeof(int16_t), count, s->wav) != count) return false;
+    s->wav_bytes += count * ENGINE_CHANNELS * sizeof(int16_t);
+    if (s->wav_bytes - s->wav_patched >= (uint64_t)sample_rate * ENGINE_CHANNELS * sizeof(int16_t)) {
+        if (fflush(s->wav) != 0) return false;
+        wav_sink_patch(s);
+    }
+    return true;
+}
+
+static void wav_sink_close(struct sink *s) {
+    if (!s->wav) return;
+    fflush(s->wav);
+    wav_sink_patch(s);
+    fclose(s->wav);
+    s->wav = NULL;
+}
+
+#ifdef SUPERMOAN_ALSA
+static bool alsa_sink_open(struct sink *s) {
+    int err = snd_pcm_open(&s->pcm, s->target, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err >= 0) {
+        err = snd_pcm_set_params(s->pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                 ENGINE_CHANNELS, (unsigned int)sample_rate, 1, 100000);
+        if (err < 0) snd_pcm_close(s->pcm);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Warning: Cannot open ALSA device %s: %s\n", s->target, snd_strerror(err));
+        s->pcm = NULL;
+        return false;
+    }
+    return true;
+}
+
+static bool alsa_sink_write(struct sink *s, const int16_t *frames, size_t count) {
+    while (count > 0) {
+        snd_pcm_sframes_t n = snd_pcm_writei(s->pcm, frames, count);
+        if (n < 0) {
+            if (snd_pcm_recover(s->pcm, (int)n, 1) < 0) return false;
+            continue;
+        }
+        frames += n * ENGINE_CHANNELS;
+        count -= (size_t)n;
+    }
+    return true;
+}
+
+static void alsa_sink_close(struct sink *s) {
+    if (s->pcm) {
+        snd_pcm_close(s->pcm);
+        s->pcm = NULL;
+    }
+}
+#else
+// Without the native backend the device is played through aplay.
+static bool alsa_sink_open(struct sink *s) {
+    s->pid = aplay_spawn(s->target, 0, 0, &s->fd, NULL);
+    return s->pid > 0;
+}
+
+static bool alsa_sink_write(struct sink *s, const int16_t *frames, size_t count) {
+    const uint8_t *p = (const uint8_t *)frames;
+    size_t remaining = count * ENGINE_CHANNELS * sizeof(int16_t);
+    while (remaining > 0) {
+        ssize_t n = write(s->fd, p, remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        remaining -= (size_t)n;
+    }
+    return true;
+}
+
+static void alsa_sink_close(struct sink *s) {
+    if (s->pid > 0) {
+        close(s->fd);
+        waitpid(s->pid, NULL, 0);
+        s->pid = -1;
+    }
+}
+#endif
+
+// Creates the sealed memfd and eventfd for the next consumer. Every
+// consumer gets a ring of its own, so one that detached and still has
+// the old mapping cannot disturb the next.
+static bool shm_ring_create(struct sink *s) {
+    size_t want = (size_t)sample_rate * SINK_BUFFER_MS / 1000;
+    size_t frames = 1;
+    while (frames < want) frames <<= 1;
+    s->shm_size = SHM_RING_HEADER + frames * ENGINE_CHANNELS * sizeof(int16_t);
+
+    s->memfd = memfd_create("supermoan-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    s->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    s->shm = MAP_FAILED;
+    if (s->memfd < 0 || s->event_fd < 0 ||
+        ftruncate(s->memfd, (off_t)s->shm_size) != 0 ||
+        // A consumer must not be able to shrink the file under the render
+        // thread, which would fault on the next write.
+        fcntl(s->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+        (s->shm = mmap(NULL, s->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->memfd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Warning: Cannot set up shared ring for %s: %s\n", s->spec, strerror(errno));
+        if (s->shm != MAP_FAILED) munmap(s->shm, s->shm_size);
+        s->shm = NULL;
+        if (s->memfd >= 0) close(s->memfd);
+        if (s->event_fd >= 0) close(s->event_fd);
+        return false;
+    }
+
+    memset(s->shm, 0, s->shm_size);
+    memcpy(s->shm->magic, SHM_RING_MAGIC, sizeof(s->shm->magic));
+    s->shm->rate = (uint32_t)sample_rate;
+    s->shm->channels = ENGINE_CHANNELS;
+    s->shm->frames = (uint32_t)frames;
+    s->shm_frames = frames;
+    s->shm_head = 0;
+    return true;
+}
+
+static void shm_ring_destroy(struct sink *s) {
+    if (!s->shm) return;
+    munmap(s->shm, s->shm_size);
+    close(s->memfd);
+    close(s->event_fd);
+    s->shm = NULL;
+}
+
+// Creates the socket that consumers connect to and the first ring.
+static bool shm_sink_open(struct sink *s) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(s->target) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Warning: Socket path %s is too long\n", s->target);
+        return false;
+    }
+    strcpy(addr.sun_path, s->target);
+
+    atomic_store(&s->shm_live, NULL);
+    atomic_store(&s->shm_feeding, false);
+    s->stop_fd = eventfd(0, EFD_CLOEXEC);
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s->stop_fd < 0 || s->listen_fd < 0) {
+        fprintf(stderr, "Warning: Cannot set up %s: %s\n", s->spec, strerror(errno));
+        goto fail;
+    }
+    unlink(s->target);
+    if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(s->listen_fd, 1) != 0) {
+        fprintf(stderr, "Warning: Cannot listen on %s: %s\n", s->target, strerror(errno));
+        goto fail;
+    }
+    if (!shm_ring_create(s)) goto fail;
+    return true;
+
+fail:
+    if (s->stop_fd >= 0) close(s->stop_fd);
+    if (s->listen_fd >= 0) close(s->listen_fd);
+    s->listen_fd = -1;
+    return false;
+}
+
+// Runs only while the serve thread has published a ring in shm_live, and
+// the serve thread leaves shm_head, shm_frames and event_fd alone until it
+// has seen the render thread finish. The consumer can write the whole
+// header, so the bounds come from shm_frames and the producer's own
+// shm_head, never from the shared fields.
+static void shm_ring_feed(struct sink *s, struct shm_ring *r, const int16_t *frames, size_t count) {
+    uint64_t head = s->shm_head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > s->shm_frames || s->shm_frames - (head - tail) < count) {
+        atomic_fetch_add_explicit(&s->frames_dropped, (long)count, memory_order_relaxed);
+        return;
+    }
+
+    int16_t *ring = (int16_t *)((uint8_t *)r + SHM_RING_HEADER);
+    size_t at = head & (s->shm_frames - 1);
+    size_t first = s->shm_frames - at < count ? s->shm_frames - at : count;
+    memcpy(ring + at * ENGINE_CHANNELS, frames, first * ENGINE_CHANNELS * sizeof(int16_t));
+    memcpy(ring, frames + first * ENGINE_CHANNELS, (count - first) * ENGINE_CHANNELS * sizeof(int16_t));
+    s->shm_head = head + count;
+    __atomic_store_n(&r->head, head + count, __ATOMIC_RELEASE);
+    atomic_fetch_add_explicit(&s->frames_written, (long)count, memory_order_relaxed);
+
+    // Pairs with the consumer setting waiting before its last look at head.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        ssize_t ignored = write(s->event_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// shm_feeding is raised before shm_live is read, and the serve thread
+// clears shm_live before it waits for shm_feeding to drop, so once it has
+// seen the flag down no feed can still be using the old ring.
+static void shm_sink_feed(struct sink *s, const int16_t *frames, size_t count) {
+    atomic_store(&s->shm_feeding, true);
+    struct shm_ring *r = atomic_load(&s->shm_live);
+    if (r) shm_ring_feed(s, r, frames, count);
+    atomic_store_explicit(&s->shm_feeding, false, memory_order_release);
+}
+
+// Hands a fresh ring's memfd and eventfd to one consumer at a time and
+// publishes the ring to the render thread while the consumer stays
+// connected.
+static void *shm_sink_serve(void *arg) {
+    struct sink *s = arg;
+    while (!atomic_load(&sinks_stopping)) {
+        struct pollfd fds[2] = {
+            { .fd = s->stop_fd, .events = POLLIN },
+            { .fd = s->listen_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0 || fds[0].revents) continue;
+
+        int conn = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) continue;
+        if (!s->shm && !shm_ring_create(s)) {
+            close(conn);
+            continue;
+        }
+
+        char byte = 0;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        union {
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        int passed[2] = { s->memfd, s->event_fd };
+        memcpy(CMSG_DATA(cmsg), passed, sizeof(passed));
+
+        __atomic_store_n(&s->shm->attached, 1, __ATOMIC_RELAXED);
+        if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1) {
+            // The consumer may have received the ring anyway, so it is
+            // not offered to the next one.
+            close(conn);
+            shm_ring_destroy(s);
+            continue;
+        }
+        atomic_store(&s->shm_live, s->shm);
+        if (debug.enabled) printf("DEBUG: Output %s: consumer attached\n", s->spec);
+
+        fds[1].fd = conn;
+        while (!atomic_load(&sinks_stopping)) {
+            if (poll(fds, 2, -1) < 0) continue;
+            if (fds[0].revents) break;
+            char discard[64];
+            if (fds[1].revents && read(conn, discard, sizeof(discard)) <= 0) break;
+        }
+
+        atomic_store(&s->shm_live, NULL);
+        while (atomic_load(&s->shm_feeding)) sched_yield();
+        __atomic_store_n(&s->shm->attached, 0, __ATOMIC_RELAXED);
+        close(conn);
+        shm_ring_destroy(s);
+        if (debug.enabled) printf("DEBUG: Output %s: consumer detached\n", s->spec);
+        if (!atomic_load(&sinks_stopping)) shm_ring_create(s);
+    }
+    return NULL;
+}
+
+static void shm_sink_wake(struct sink *s) {
+    uint64_t one = 1;
+    ssize_t ignored = write(s->stop_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+static void shm_sink_close(struct sink *s) {
+    if (s->listen_fd < 0) return;
+    unlink(s->target);
+    close(s->listen_fd);
+    close(s->stop_fd);
+    s->listen_fd = -1;
+    shm_ring_destroy(s);
+}
+
+static const struct sink_type sink_types[] = {
+    { "wav", wav_sink_open, wav_sink_write, wav_sink_close, NULL, NULL, NULL },
+    { "alsa", alsa_sink_open, alsa_sink_write, alsa_sink_close, NULL, NULL, NULL },
+    { "shm", shm_sink_open, NULL, shm_sink_close, shm_sink_feed, shm_sink_serve, shm_sink_wake },
+};
+
+// --shm-consume: attaches to a shm: output at path and copies what it
+// renders to stdout as raw 16-bit stereo, until the output goes away.
+int shm_consume(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (strlen(path) >= sizeof(addr.sun_path) || sock < 0) {
+        fprintf(stderr, "Error: Cannot connect to %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Cannot connect to %s: %s\n", path, strerror(errno));
+        close(sock);
+        return 1;
+    }
+
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        fprintf(stderr, "Error: %s did not pass a shared ring\n", path);
+        close(sock);
+        return 1;
+    }
+    int passed[2];
+    memcpy(passed, CMSG_DATA(cmsg), sizeof(passed));
+    int memfd = passed[0], event_fd = passed[1];
+
+    struct stat st;
+    struct shm_ring *r = MAP_FAILED;
+    if (fstat(memfd, &st) == 0 && st.st_size > SHM_RING_HEADER) {
+        r = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    if (r == MAP_FAILED || memcmp(r->magic, SHM_RING_MAGIC, sizeof(r->magic)) != 0 ||
+        r->channels != ENGINE_CHANNELS ||
+        SHM_RING_HEADER + (uint64_t)r->frames * ENGINE_CHANNELS * sizeof(int16_t) > (uint64_t)st.st_size) {
+        fprintf(stderr, "Error: %s passed an unknown ring\n", path);
+        if (r != MAP_FAILED) munmap(r, (size_t)st.st_size);
+        close(memfd);
+        close(event_fd);
+        close(sock);
+        return 1;
+    }
+    if (debug.enabled) {
+        fprintf(stderr, "DEBUG: Attached to %s: %u Hz, %u channels, %u frame ring\n",
+                path, r->rate, r->channels, r->frames);
+    }
+
+    const int16_t *ring = (const int16_t *)((const uint8_t *)r + SHM_RING_HEADER);
+    int status = 0;
+    for (;;) {
+        uint64_t tail = r->tail;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            __atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+                struct pollfd fds[2] = {
+                    { .fd = event_fd, .events = POLLIN },
+                    { .fd = sock, .events = POLLIN },
+                };
+                if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+                if (fds[1].revents) break;
+                uint64_t count;
+                ssize_t ignored = read(event_fd, &count, sizeof(count));
+                (void)ignored;
+            }
+            __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        size_t at = tail & (r->frames - 1);
+        size_t count = r->frames - at < head - tail ? r->frames - at : head - tail;
+        const uint8_t *p = (const uint8_t *)(ring + at * ENGINE_CHANNELS);
+        size_t remaining = count * ENGINE_CHANNELS * sizeof(int16_t);
+        while (remaining > 0) {
+            ssize_t n = write(STDOUT_FILENO, p, remaining);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                status = 1;
+                goto done;
+            }
+            p += n;
+            remaining -= (size_t)n;
+        }
+        __atomic_store_n(&r->tail, tail + count, __ATOMIC_RELEASE);
+    }
+
+done:
+    munmap(r, (size_t)st.st_size);
+    close(memfd);
+    close(event_fd);
+    close(sock);
+    return status;
+}
+
+// Splits "type:target" for --tee; false if the type is unknown or the
+// target missing.
+bool add_sink(const char *spec) {
+    const char *colon = strchr(spec, ':');
+    if (!colon || colon[1] == '\0' || sink_count == MAX_SINKS) return false;
+    for (size_t i = 0; i < sizeof(sink_types) / sizeof(sink_types[0]); i++) {
+        if (strlen(sink_types[i].prefix) == (size_t)(colon - spec) &&
+            strncmp(sink_types[i].prefix, spec, (size_t)(colon - spec)) == 0) {
+            sinks[sink_count].spec = spec;
+            sinks[sink_count].target = colon + 1;
+            sinks[sink_count].type = &sink_types[i];
+            sink_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called by the render thread with every mixed period. Lock-free: a ring
+// without room for the whole period drops it for that sink.
+static void sinks_feed(const int16_t *frames, size_t count) {
+    for (int i = 0; i < sink_count; i++) {
+        struct sink *s = &sinks[i];
+        if (!s->started || atomic_load_explicit(&s->failed, memory_order_relaxed)) continue;
+        if (s->type->feed) {
+            s->type->feed(s, frames, count);
+            continue;
+        }
+
+        size_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+        if (s->ring_frames - (head - tail) < count) {
+            atomic_fetch_add_explicit(&s->frames_dropped, (long)count, memory_order_relaxed);
+            continue;
+        }
+
+        size_t at = head & (s->ring_frames - 1);
+        size_t first = s->ring_frames - at < count ? s->ring_frames - at : count;
+        memcpy(s->ring + at * ENGINE_CHANNELS, frames, first * ENGINE_CHANNELS * sizeof(int16_t));
+        memcpy(s->ring, frames + first * ENGINE_CHANNELS, (count - first) * ENGINE_CHANNELS * sizeof(int16_t));
+        atomic_store_explicit(&s->head, head + count, memory_order_release);
+        sem_post(&s->wakeup);
+    }
+}
+
+static void *sink_thread(void *arg) {
+    struct sink *s = arg;
+    for (;;) {
+        while (sem_wait(&s->wakeup) != 0 && errno == EINTR) {
+        }
+
+        size_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+        while (tail != head) {
+            size_t at = tail & (s->ring_frames - 1);
+            size_t count = s->ring_frames - at < head - tail ? s->ring_frames - at : head - tail;
+            if (!s->type->write(s, s->ring + at * ENGINE_CHANNELS, count)) {
+                fprintf(stderr, "Warning: Output %s failed, dropping it\n", s->spec);
+                atomic_store(&s->failed, true);
+                return NULL;
+            }
+            tail += count;
+            atomic_store_explicit(&s->tail, tail, memory_order_release);
+            atomic_fetch_add_explicit(&s->frames_written, (long)count, memory_order_relaxed);
+        }
+        if (atomic_load(&sinks_stopping)) return NULL;
+    }
+}
+
+// Opens the sinks at the primary output's rate and starts their threads
+// with SIGINT blocked. A sink that cannot be opened is skipped.
+static void sinks_start(void) {
+    size_t want = (size_t)sample_rate * SINK_BUFFER_MS / 1000;
+    size_t ring_frames = 1;
+    while (ring_frames < want) ring_frames <<= 1;
+
+    atomic_store(&sinks_stopping, false);
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    for (int i = 0; i < sink_count; i++) {
+        struct sink *s = &sinks[i];
+        if (!s->type->feed) {
+            s->ring = calloc(ring_frames * ENGINE_CHANNELS, sizeof(int16_t));
+            if (!s->ring) continue;
+        }
+        if (!s->type->open(s)) {
+            free(s->ring);
+            s->ring = NULL;
+            continue;
+        }
+        if (s->ring) {
+            // Faulted in here rather than by the render thread's first copy.
+            memset(s->ring, 0, ring_frames * ENGINE_CHANNELS * sizeof(int16_t));
+            s->ring_frames = ring_frames;
+            atomic_store(&s->head, 0);
+            atomic_store(&s->tail, 0);
+            sem_init(&s->wakeup, 0, 0);
+        }
+
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+        int err = pthread_create(&s->thread, NULL, s->type->serve ? s->type->serve : sink_thread, s);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        if (err != 0) {
+            fprintf(stderr, "Warning: Failed to create thread for output %s: %s\n", s->spec, strerror(err));
+            s->type->close(s);
+            if (s->ring) sem_destroy(&s->wakeup);
+            free(s->ring);
+            s->ring = NULL;
+            continue;
+        }
+        s->started = true;
+        s->opened = true;
+        startup_mark("Output %s open", s->spec);
+    }
+}
+
+void print_sink_stats(void) {
+    for (int i = 0; i < sink_count; i++) {
+        const struct sink *s = &sinks[i];
+        printf("Output %s: %ld frames written, %ld dropped%s\n", s->spec,
+               atomic_load(&s->frames_written), atomic_load(&s->frames_dropped),
+               !s->opened ? ", not open" : atomic_load(&s->failed) ? ", failed" : "");
+    }
+}
+
+// Gives every sink SINK_DRAIN_MS to write out what is still in its ring,
+// then closes it. An aplay child that stopped reading is killed so its
+// writer comes loose.
+static void sinks_stop(void) {
+    atomic_store(&sinks_stopping, true);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SINK_DRAIN_MS / 1000;
+    for (int i = 0; i < sink_count; i++) {
+        struct sink *s = &sinks[i];
+        if (!s->started) continue;
+        if (s->type->wake) {
+            s->type->wake(s);
+        } else {
+            sem_post(&s->wakeup);
+        }
+        if (pthread_timedjoin_np(s->thread, NULL, &deadline) != 0) {
+            fprintf(stderr, "Warning: Output %s did not drain in time\n", s->spec);
+            if (s->pid > 0) kill(s->pid, SIGKILL);
+            pthread_join(s->thread, NULL);
+        }
+        s->type->close(s);
+        if (s->ring) sem_destroy(&s->wakeup);
+        free(s->ring);
+        s->ring = NULL;
+        s->started = false;
+    }
+}
+
+// One record of the --events stream as the reader queues it. On the wire
+// it is EVENT_RECORD_BYTES little-endian bytes: event time in ns (s64),
+// sequence (u32), motion magnitude (f32), device index (u16), level (u8)
+// and a zero byte, after a EVENT_HEADER_BYTES header of the magic, the
+// record size and the number of levels (u32 each).
+struct event_record {
+    int64_t time_ns;
+    uint32_t sequence;
+    float magnitude;
+    uint16_t device;
+    uint8_t level;
+};
+
+// The reader queues a record for every trigger it computes and moves on;
+// the writer thread sends whatever has queued up since its last write in
+// one go. A consumer that stalls fills the queue and the records that do
+// not fit are dropped and counted. Sequence numbers count dropped records
+// too, so the consumer can see the gaps.
+struct event_stream {
+    int fd;
+    bool fifo;
+    struct event_record queue[EVENT_QUEUE_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+    uint32_t sequence;
+    sem_t wakeup;
+    pthread_t thread;
+    bool started;
+    atomic_bool stopping;
+    atomic_bool failed;
+    atomic_long written;
+    atomic_long dropped;
+};
+
+static struct event_stream event_stream = { .fd = -1 };
+
+// Opens the --events output: unix:SOCKET connects to a listening stream
+// socket and anything else is created as a file, except that a FIFO is
+// left to the writer thread, which waits there for a reader. For -, main()
+// has already moved stdout aside.
+bool event_stream_open(void) {
+    if (event_stream.fd >= 0) return true;
+
+    if (strncmp(event_path, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(event_path + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: Socket path %s is too long\n", event_path + 5);
+            return false;
+        }
+        strcpy(addr.sun_path, event_path + 5);
+        event_stream.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (event_stream.fd < 0 || connect(event_stream.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "Error: Cannot connect to %s: %s\n", event_path + 5, strerror(errno));
+            if (event_stream.fd >= 0) close(event_stream.fd);
+            event_stream.fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    struct stat st;
+    if (stat(event_path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        event_stream.fifo = true;
+        return true;
+    }
+    event_stream.fd = open(event_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (event_stream.fd < 0) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", event_path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool event_stream_send(const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(event_stream.fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool event_stream_header(void) {
+    uint8_t header[EVENT_HEADER_BYTES] = {0};
+    memcpy(header, EVENT_STREAM_MAGIC, sizeof(EVENT_STREAM_MAGIC));
+    write_le32(header + 8, EVENT_RECORD_BYTES);
+    write_le32(header + 12, NUM_INTENSITY_LEVELS);
+    return event_stream_send(header, sizeof(header));
+}
+
+// Blocks until the FIFO has a reader. Whatever queued up meanwhile is
+// stale by then and dropped.
+static bool event_stream_reopen(void) {
+    if (event_stream.fd >= 0) close(event_stream.fd);
+    event_stream.fd = open(event_path, O_WRONLY | O_CLOEXEC);
+    if (event_stream.fd < 0) return false;
+
+    unsigned int head = atomic_load_explicit(&event_stream.head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&event_stream.tail, memory_order_relaxed);
+    atomic_fetch_add(&event_stream.dropped, (long)(head - tail));
+    atomic_store_explicit(&event_stream.tail, head, memory_order_release);
+    if (debug.enabled) {
+        printf("DEBUG: Event stream %s has a reader\n", event_path);
+    }
+    return event_stream_header();
+}
+
+static void *event_stream_thread(void *arg) {
+    (void)arg;
+    static uint8_t batch[EVENT_BATCH * EVENT_RECORD_BYTES];
+    bool connected = event_stream.fifo ? event_stream_reopen() : event_stream_header();
+
+    for (;;) {
+        // A FIFO whose reader went away waits for the next one; any other
+        // output that cannot be written to is given up.
+        while (!connected && event_stream.fifo && !atomic_load(&event_stream.stopping)) {
+            if (debug.enabled) {
+                printf("DEBUG: Event stream %s lost its reader\n", event_path);
+            }
+            connected = event_stream_reopen();
+            if (!connected && event_stream.fd < 0) break;
+        }
+        if (!connected) {
+            if (!atomic_load(&event_stream.stopping)) {
+                fprintf(stderr, "Warning: Event stream %s failed: %s, dropping it\n", event_path, strerror(errno));
+            }
+            atomic_store(&event_stream.failed, true);
+            return NULL;
+        }
+
+        while (sem_wait(&event_stream.wakeup) != 0 && errno == EINTR) {
+        }
+
+        unsigned int tail = atomic_load_explicit(&event_stream.tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&event_stream.head, memory_order_acquire);
+        while (connected && tail != head) {
+            unsigned int count = head - tail < EVENT_BATCH ? head - tail : EVENT_BATCH;
+            for (unsigned int i = 0; i < count; i++) {
+                const struct event_record *r = &event_stream.queue[(tail + i) % EVENT_QUEUE_SIZE];
+                uint8_t *p = batch + i * EVENT_RECORD_BYTES;
+                uint32_t magnitude;
+                memcpy(&magnitude, &r->magnitude, sizeof(magnitude));
+                write_le32(p, (uint32_t)r->time_ns);
+                write_le32(p + 4, (uint32_t)((uint64_t)r->time_ns >> 32));
+                write_le32(p + 8, r->sequence);
+                write_le32(p + 12, magnitude);
+                write_le16(p + 16, r->device);
+                p[18] = r->level;
+                p[19] = 0;
+            }
+            tail += count;
+            atomic_store_explicit(&event_stream.tail, tail, memory_order_release);
+
+            connected = event_stream_send(batch, count * EVENT_RECORD_BYTES);
+            atomic_fetch_add_explicit(connected ? &event_stream.written : &event_stream.dropped,
+                                      (long)count, memory_order_relaxed);
+            head = atomic_load_explicit(&event_stream.head, memory_order_acquire);
+        }
+        if (connected && atomic_load(&event_stream.stopping)) return NULL;
+    }
+}
+
+// Called by the reader. Never blocks: a full queue drops the record.
+static void event_stream_push(const struct timespec *time, int source, int level, double magnitude) {
+    if (!event_stream.started) return;
+    uint32_t sequence = event_stream.sequence++;
+
+    unsigned int head = atomic_load_explicit(&event_stream.head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&event_stream.tail, memory_order_acquire);
+    if (head - tail >= EVENT_QUEUE_SIZE || atomic_load_explicit(&event_stream.failed, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&event_stream.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct event_record *r = &event_stream.queue[head % EVENT_QUEUE_SIZE];
+    r->time_ns = (int64_t)time->tv_sec * 1000000000LL + time->tv_nsec;
+    r->sequence = sequence;
+    r->magnitude = (float)magnitude;
+    r->device = (uint16_t)source;
+    r->level = (uint8_t)level;
+    atomic_store_explicit(&event_stream.head, head + 1, memory_order_release);
+    sem_post(&event_stream.wakeup);
+}
+
+static void event_stream_start(void) {
+    if (!event_path) return;
+    atomic_store(&event_stream.stopping, false);
+    sem_init(&event_stream.wakeup, 0, 0);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    int err = pthread_create(&event_stream.thread, NULL, event_stream_thread, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Warning: Failed to create thread for event stream %s: %s\n", event_path, strerror(err));
+        sem_destroy(&event_stream.wakeup);
+        return;
+    }
+    event_stream.started = true;
+    startup_mark("Event stream %s open", event_path);
+}
+
+// Gives the writer EVENT_DRAIN_MS to send what is still queued. One stuck
+// in a write or waiting for a FIFO reader is cancelled.
+static void event_stream_stop(void) {
+    if (!event_stream.started) return;
+    atomic_store(&event_stream.stopping, true);
+    sem_post(&event_stream.wakeup);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += EVENT_DRAIN_MS / 1000;
+    if (pthread_timedjoin_np(event_stream.thread, NULL, &deadline) != 0) {
+        fprintf(stderr, "Warning: Event stream %s did not drain in time\n", event_path);
+        pthread_cancel(event_stream.thread);
+        pthread_join(event_stream.thread, NULL);
+    }
+    sem_destroy(&event_stream.wakeup);
+    if (event_stream.fd >= 0) close(event_stream.fd);
+    event_stream.fd = -1;
+    event_stream.started = false;
+}
+
+void print_event_stream_stats(void) {
+    if (!event_path) return;
+    printf("Event stream %s: %ld records written, %ld dropped%s\n", event_path,
+           atomic_load(&event_stream.written), atomic_load(&event_stream.dropped),
+           atomic_load(&event_stream.failed) ? ", failed" : "");
+}
+
+// Called by the reader. Never blocks: a full queue drops the trigger.
+void engine_trigger(int level, const struct timespec *time) {
+    if (atomic_load_explicit(&output_down, memory_order_relaxed)) {
+        atomic_fetch_add(&engine.triggers_dropped_outage, 1);
+        return;
+    }
+    if (!no_sound && !synth_render) {
+        int source = clip_source[level];
+        if (lazy_bank) bank_follow_trend(level, time);
+
+        if (atomic_load_explicit(&bank_state[source], memory_order_acquire) == LEVEL_READY) {
+            atomic_fetch_add(&bank_stats.hits, 1);
+            if (atomic_load_explicit(&bank_prefetched[source], memory_order_relaxed) &&
+                atomic_exchange(&bank_prefetched[source], false)) {
+                atomic_fetch_add(&bank_stats.prefetches_used, 1);
+            }
+        } else {
+            atomic_fetch_add(&bank_stats.misses, 1);
+            bank_request(source, true);
+            if (!lazy_bank) {
+                atomic_fetch_add(&engine.triggers_skipped_loading, 1);
+                return;
+            }
+        }
+    }
+
+    unsigned int head = atomic_load_explicit(&trigger_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&trigger_tail, memory_order_acquire);
+    if (head - tail >= TRIGGER_QUEUE_SIZE) {
+        atomic_fetch_add(&engine.triggers_dropped, 1);
+        return;
+    }
+
+    trigger_queue[head % TRIGGER_QUEUE_SIZE].level = level;
+    trigger_queue[head % TRIGGER_QUEUE_SIZE].time = *time;
+    atomic_store_explicit(&trigger_head, head + 1, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&engine.level_triggers[level], 1, memory_order_relaxed);
+
+    if (atomic_load(&render_sleeping)) {
+        pthread_mutex_lock(&mutex);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+static bool trigger_queue_empty(void) {
+    return atomic_load(&trigger_head) == atomic_load(&trigger_tail);
+}
+
+// Drains the queue, keeping only the newest trigger: at most one voice is
+// started per period and, while the pool is full, the newest trigger
+// waits for the next free voice, as the single-player design always did.
+static bool take_newest_trigger(struct trigger *out) {
+    unsigned int head = atomic_load_explicit(&trigger_head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&trigger_tail, memory_order_relaxed);
+    if (head == tail) return false;
+
+    *out = trigger_queue[(head - 1) % TRIGGER_QUEUE_SIZE];
+    atomic_store_explicit(&trigger_tail, head, memory_order_release);
+    return true;
+}
+
+// Puts every slot below max_voices back on the free stack, lowest on top.
+static void reset_voice_pool(void) {
+    pool.active_count = 0;
+    pool.free_count = 0;
+    for (int i = max_voices - 1; i >= 0; i--) {
+        pool.free[pool.free_count++] = (uint8_t)i;
+    }
+    atomic_store(&engine.active_voices, 0);
+}
+
+// Shedding load halves the voices that may play at once; voices already
+// playing are left to finish.
+static bool voice_available(void) {
+    int limit = max_voices;
+    if (atomic_load_explicit(&degrade_level, memory_order_relaxed) >= 1 && limit > 1) limit /= 2;
+    return pool.free_count > 0 && pool.active_count < limit;
+}
+
+// Derives a filtered voice from the distance between its level and the
+// source level playing it: per level down, the lowpass cutoff falls by
+// FILTER_OCTAVES_PER_LEVEL, the gain by FILTER_DB_PER_LEVEL and the pitch
+// by FILTER_SEMITONES_PER_LEVEL; levels above the source rise the same
+// way, with the cutoff capped. The filter is a trapezoidal (TPT)
+// state-variable lowpass, which stays stable under any cutoff.
+static void filter_voice_setup(int slot, int level) {
+    int steps = level - clip_source[level];
+    double cutoff = FILTER_MAX_CUTOFF * exp2(FILTER_OCTAVES_PER_LEVEL * (steps < 0 ? steps : 0));
+    if (cutoff > 0.45 * sample_rate) cutoff = 0.45 * sample_rate;
+
+    double g = tan(3.14159265358979323846 * cutoff / sample_rate);
+    double a1 = 1.0 / (1.0 + g * (g + 1.0 / FILTER_Q));
+    pool.svf_a1[slot] = (float)a1;
+    pool.svf_a2[slot] = (float)(g * a1);
+    pool.svf_a3[slot] = (float)(g * g * a1);
+    memset(pool.svf_ic1[slot], 0, sizeof(pool.svf_ic1[slot]));
+    memset(pool.svf_ic2[slot], 0, sizeof(pool.svf_ic2[slot]));
+
+    pool.gain[slot] = (float)pow(10.0, steps * FILTER_DB_PER_LEVEL / 20.0);
+    pool.increment[slot] = (uint64_t)((double)pool.increment[slot] *
+                                      exp2(steps * FILTER_SEMITONES_PER_LEVEL / 12.0));
+}
+
+// Derives a synthesized voice from its intensity: harder movement gives a
+// longer, higher, louder and less breathy sound with a more open mouth.
+static void synth_voice_setup(int slot, int level) {
+    double t = (double)(level - 1) / (NUM_INTENSITY_LEVELS - 1);
+    synth.elapsed[slot] = 0;
+    synth.length[slot] = (uint32_t)((SYNTH_BASE_MS + SYNTH_MS_PER_LEVEL * level) * (long)sample_rate / 1000);
+    synth.noise[slot] = 0x9e3779b9u * (uint32_t)(slot + 1) + (uint32_t)voice_info[slot].plays;
+    synth.phase[slot] = 0.0f;
+    synth.f0[slot] = (float)(SYNTH_MIN_F0 + (SYNTH_MAX_F0 - SYNTH_MIN_F0) * t);
+    synth.open_quotient[slot] = (float)(0.75 - 0.25 * t);
+    synth.breath[slot] = (float)(0.3 - 0.2 * t);
+
+    for (int k = 0; k < SYNTH_FORMANTS; k++) {
+        double freq = synth_formants[k][0] + (k == 0 ? SYNTH_F1_PER_LEVEL * level : 0.0);
+        double r = exp(-3.14159265358979323846 * synth_formants[k][1] / sample_rate);
+        double theta = 2.0 * 3.14159265358979323846 * freq / sample_rate;
+        // Scaled for unity gain at the resonance peak.
+        double peak = (1.0 - r) * sqrt(1.0 - 2.0 * r * cos(2.0 * theta) + r * r);
+        synth.a0[k][slot] = (float)(synth_formants[k][2] * peak);
+        synth.b1[k][slot] = (float)(2.0 * r * cos(theta));
+        synth.b2[k][slot] = (float)(-r * r);
+        synth.y1[k][slot] = 0.0f;
+        synth.y2[k][slot] = 0.0f;
+    }
+    pool.gain[slot] = (float)(0.35 + 0.65 * t);
+}
+
+static void start_voice(const struct trigger *t, size_t offset) {
+    if (!voice_available()) return;
+
+    int slot = pool.free[--pool.free_count];
+    pool.position[slot] = 0;
+    pool.gain[slot] = 1.0f;
+    pool.offset[slot] = (uint32_t)offset;
+    if (synth_render) {
+        pool.clip[slot] = NULL;
+        synth_voice_setup(slot, t->level);
+    } else {
+        pool.clip[slot] = &bank[clip_source[t->level]];
+        pool.increment[slot] = ((uint64_t)pool.clip[slot]->rate << VOICE_FRAC_BITS) / (uint64_t)sample_rate;
+        if (filter_render) filter_voice_setup(slot, t->level);
+    }
+    pool.active[pool.active_count++] = (uint8_t)slot;
+
+    struct voice_info *info = &voice_info[slot];
+    info->level = t->level;
+    info->trigger_time = t->time;
+    clock_gettime(CLOCK_MONOTONIC, &info->start_time);
+    info->plays++;
+    latency_record(&trigger_latency, timespec_diff_us(&info->start_time, &t->time));
+
+    // stdio takes a lock, so real-time callbacks stay silent.
+    if (debug.enabled && backend->write) {
+        if (no_sound) {
+            printf("DEBUG: Sound playback disabled, would have played: %s/%d.wav\n",
+                   sound_directory, t->level);
+        } else if (synth_render) {
+            printf("DEBUG: Synthesizing sound, intensity: %d\n", t->level);
+        } else {
+            printf("DEBUG: Playing sound from directory: %s, intensity: %d\n",
+                   sound_directory, t->level);
+        }
+    }
+}
+
+// Scalar kernels: the reference and the fallback on every architecture.
+static void gain_scalar(float *dst, const float *src, size_t n, float g) {
+    for (size_t i = 0; i < n; i++) dst[i] = src[i] * g;
+}
+
+static void mix_scalar(float *dst, const float *src, size_t n, float g) {
+    for (size_t i = 0; i < n; i++) dst[i] += src[i] * g;
+}
+
+static void pan_scalar(float *left, float *right, const float *src, size_t n, float gl, float gr) {
+    for (size_t i = 0; i < n; i++) {
+        left[i] += src[i] * gl;
+        right[i] += src[i] * gr;
+    }
+}
+
+static inline int16_t float_to_s16(float value) {
+    float scaled = value * 32767.0f;
+    if (scaled > 32767.0f) return 32767;
+    if (scaled < -32768.0f) return -32768;
+    return (int16_t)lrintf(scaled);
+}
+
+static void to_s16_scalar(int16_t *out, const float *left, const float *right, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = float_to_s16(left[i]);
+        out[2 * i + 1] = float_to_s16(right[i]);
+    }
+}
+
+static bool always_supported(void) {
+    return true;
+}
+
+#ifdef SUPERMOAN_X86
+// The vector kernels use unaligned loads, since voices start at arbitrary
+// positions, and leave the tail to the scalar code. Samples are clamped
+// before the int32 conversion, which turns anything out of range into
+// INT32_MIN; the int16 pack then saturates.
+__attribute__((target("sse2")))
+static void gain_sse2(float *dst, const float *src, size_t n, float g) {
+    __m128 vg = _mm_set1_ps(g);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), vg));
+    gain_scalar(dst + i, src + i, n - i, g);
+}
+
+__attribute__((target("sse2")))
+static void mix_sse2(float *dst, const float *src, size_t n, float g) {
+    __m128 vg = _mm_set1_ps(g);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_loadu_ps(dst + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(src + i), vg)));
+    }
+    mix_scalar(dst + i, src + i, n - i, g);
+}
+
+__attribute__((target("sse2")))
+static void pan_sse2(float *left, float *right, const float *src, size_t n, float gl, float gr) {
+    __m128 vl = _mm_set1_ps(gl), vr = _mm_set1_ps(gr);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(src + i);
+        _mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), _mm_mul_ps(x, vl)));
+        _mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), _mm_mul_ps(x, vr)));
+    }
+    pan_scalar(left + i, right + i, src + i, n - i, gl, gr);
+}
+
+__attribute__((target("sse2")))
+static void to_s16_sse2(int16_t *out, const float *left, const float *right, size_t n) {
+    __m128 scale = _mm_set1_ps(32767.0f), hi = _mm_set1_ps(32767.0f), lo = _mm_set1_ps(-32768.0f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 l = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(left + i), scale), hi), lo);
+        __m128 r = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(right + i), scale), hi), lo);
+        __m128i li = _mm_cvtps_epi32(l), ri = _mm_cvtps_epi32(r);
+        __m128i packed = _mm_packs_epi32(_mm_unpacklo_epi32(li, ri), _mm_unpackhi_epi32(li, ri));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), packed);
+    }
+    to_s16_scalar(out + 2 * i, left + i, right + i, n - i);
+}
+
+static bool sse2_supported(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2,fma")))
+static void gain_avx2(float *dst, const float *src, size_t n, float g) {
+    __m256 vg = _mm256_set1_ps(g);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), vg));
+    gain_scalar(dst + i, src + i, n - i, g);
+}
+
+__attribute__((target("avx2,fma")))
+static void mix_avx2(float *dst, const float *src, size_t n, float g) {
+    __m256 vg = _mm256_set1_ps(g);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(_mm256_loadu_ps(src + i), vg, _mm256_loadu_ps(dst + i)));
+    }
+    mix_scalar(dst + i, src + i, n - i, g);
+}
+
+__attribute__((target("avx2,fma")))
+static void pan_avx2(float *left, float *right, const float *src, size_t n, float gl, float gr) {
+    __m256 vl = _mm256_set1_ps(gl), vr = _mm256_set1_ps(gr);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(src + i);
+        _mm256_storeu_ps(left + i, _mm256_fmadd_ps(x, vl, _mm256_loadu_ps(left + i)));
+        _mm256_storeu_ps(right + i, _mm256_fmadd_ps(x, vr, _mm256_loadu_ps(right + i)));
+    }
+    pan_scalar(left + i, right + i, src + i, n - i, gl, gr);
+}
+
+// unpack and pack both work within 128-bit lanes, which leaves the
+// frames in order: lane 0 holds frames 0-3, lane 1 frames 4-7.
+__attribute__((target("avx2,fma")))
+static void to_s16_avx2(int16_t *out, const float *left, const float *right, size_t n) {
+    __m256 scale = _mm256_set1_ps(32767.0f), hi = _mm256_set1_ps(32767.0f), lo = _mm256_set1_ps(-32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 l = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(left + i), scale), hi), lo);
+        __m256 r = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(right + i), scale), hi), lo);
+        __m256i li = _mm256_cvtps_epi32(l), ri = _mm256_cvtps_epi32(r);
+        __m256i packed = _mm256_packs_epi32(_mm256_unpacklo_epi32(li, ri), _mm256_unpackhi_epi32(li, ri));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), packed);
+    }
+    to_s16_scalar(out + 2 * i, left + i, right + i, n - i);
+}
+
+static bool avx2_supported(void) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void gain_avx512(float *dst, const float *src, size_t n, float g) {
+    __m512 vg = _mm512_set1_ps(g);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) _mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_loadu_ps(src + i), vg));
+    gain_scalar(dst + i, src + i, n - i, g);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void mix_avx512(float *dst, const float *src, size_t n, float g) {
+    __m512 vg = _mm512_set1_ps(g);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_fmadd_ps(_mm512_loadu_ps(src + i), vg, _mm512_loadu_ps(dst + i)));
+    }
+    mix_scalar(dst + i, src + i, n - i, g);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void pan_avx512(float *left, float *right, const float *src, size_t n, float gl, float gr) {
+    __m512 vl = _mm512_set1_ps(gl), vr = _mm512_set1_ps(gr);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 x = _mm512_loadu_ps(src + i);
+        _mm512_storeu_ps(left + i, _mm512_fmadd_ps(x, vl, _mm512_loadu_ps(left + i)));
+        _mm512_storeu_ps(right + i, _mm512_fmadd_ps(x, vr, _mm512_loadu_ps(right + i)));
+    }
+    pan_scalar(left + i, right + i, src + i, n - i, gl, gr);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void to_s16_avx512(int16_t *out, const float *left, const float *right, size_t n) {
+    __m512 scale = _mm512_set1_ps(32767.0f), hi = _mm512_set1_ps(32767.0f), lo = _mm512_set1_ps(-32768.0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 l = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(_mm512_loadu_ps(left + i), scale), hi), lo);
+        __m512 r = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(_mm512_loadu_ps(right + i), scale), hi), lo);
+        __m512i li = _mm512_cvtps_epi32(l), ri = _mm512_cvtps_epi32(r);
+        __m512i packed = _mm512_packs_epi32(_mm512_unpacklo_epi32(li, ri), _mm512_unpackhi_epi32(li, ri));
+        _mm512_storeu_si512((void *)(out + 2 * i), packed);
+    }
+    to_s16_scalar(out + 2 * i, left + i, right + i, n - i);
+}
+
+static bool avx512_supported(void) {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+// Fastest first; the scalar set always matches.
+static const struct mix_kernels mix_kernel_sets[] = {
+#ifdef SUPERMOAN_X86
+    { "avx512", gain_avx512, mix_avx512, pan_avx512, to_s16_avx512, avx512_supported },
+    { "avx2", gain_avx2, mix_avx2, pan_avx2, to_s16_avx2, avx2_supported },
+    { "sse2", gain_sse2, mix_sse2, pan_sse2, to_s16_sse2, sse2_supported },
+#endif
+    { "scalar", gain_scalar, mix_scalar, pan_scalar, to_s16_scalar, always_supported },
+};
+
+#define NUM_MIX_KERNEL_SETS (sizeof(mix_kernel_sets) / sizeof(mix_kernel_sets[0]))
+
+static const struct mix_kernels *kernels = &mix_kernel_sets[NUM_MIX_KERNEL_SETS - 1];
+
+const struct mix_kernels *select_mix_kernels(void) {
+#ifdef SUPERMOAN_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < NUM_MIX_KERNEL_SETS; i++) {
+        if (mix_kernel_sets[i].supported()) return &mix_kernel_sets[i];
+    }
+    return &mix_kernel_sets[NUM_MIX_KERNEL_SETS - 1];
+}
+
+// The mix bus: one float plane per output channel. engine_render_float()
+// points it at the caller's planes for a period, so the kernels make no
+// assumption about its alignment.
+static float bus_storage[ENGINE_CHANNELS][MAX_PERIOD_FRAMES] __attribute__((aligned(64)));
+static float *bus[ENGINE_CHANNELS] = { bus_storage[0], bus_storage[1] };
+
+// Mixes a voice whose increment is not one frame per frame (its clip was
+// converted before the output changed rate) by linear interpolation, or
+// nearest neighbour when shedding load, straight into the bus. Returns
+// false once the clip ends.
+static bool mix_voice_resampled(int slot, size_t from, size_t frames) {
+    const struct sample_clip *clip = pool.clip[slot];
+    uint64_t position = pool.position[slot];
+    uint64_t increment = pool.increment[slot];
+    float gain = pool.gain[slot];
+    bool nearest = atomic_load_explicit(&degrade_level, memory_order_relaxed) >= 2;
+
+    for (size_t i = from; i < frames; i++) {
+        size_t index = (size_t)(position >> VOICE_FRAC_BITS);
+        if (index + 1 >= clip->length) {
+            pool.position[slot] = position;
+            return false;
+        }
+        float frac = (float)(position & (VOICE_UNITY - 1)) / (float)VOICE_UNITY;
+        if (nearest) {
+            index += frac >= 0.5f;
+            for (int c = 0; c < ENGINE_CHANNELS; c++) {
+                bus[c][i] += clip->planes[c][index] * gain;
+            }
+        } else {
+            for (int c = 0; c < ENGINE_CHANNELS; c++) {
+                float a = clip->planes[c][index], b = clip->planes[c][index + 1];
+                bus[c][i] += (a + (b - a) * frac) * gain;
+            }
+        }
+        position += increment;
+    }
+    pool.position[slot] = position;
+    return true;
+}
+
+// Filter render lanes: voice v of a group of FILTER_GROUP_VOICES uses
+// lanes 2v (left) and 2v + 1 (right), so one vector step advances the
+// filters of the whole group by a frame.
+typedef float filter_vec __attribute__((vector_size(FILTER_LANES * sizeof(float))));
+
+// The filter update written as a 2x2 state matrix: the new states and
+// the output are each a weighted sum of the two states and the input,
+// which keeps the serial dependency per frame to one multiply and two
+// adds. The output weights include the voice gain.
+struct filter_group {
+    filter_vec m11, m12, b1;
+    filter_vec m21, m22, b2;
+    filter_vec c1, c2, c3;
+    filter_vec ic1, ic2;
+};
+
+static filter_vec filter_in[MAX_PERIOD_FRAMES];
+
+#ifdef SUPERMOAN_X86
+#define FILTER_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define FILTER_CLONES
+#endif
+
+// Runs a group's filters over a period of input lanes and adds the
+// scaled outputs to the bus. The recursion is serial in time, so the
+// vectors run across voices instead; ifunc clones pick AVX2 when present.
+FILTER_CLONES
+static void filter_group_run(struct filter_group *g, size_t frames) {
+    filter_vec ic1 = g->ic1, ic2 = g->ic2;
+    for (size_t i = 0; i < frames; i++) {
+        filter_vec x = filter_in[i];
+        filter_vec y = g->c1 * ic1 + g->c2 * ic2 + g->c3 * x;
+        filter_vec next1 = (g->b1 * x + g->m11 * ic1) + g->m12 * ic2;
+        ic2 = (g->b2 * x + g->m22 * ic2) + g->m21 * ic1;
+        ic1 = next1;
+        bus[0][i] += (y[0] + y[2]) + (y[4] + y[6]);
+        bus[1][i] += (y[1] + y[3]) + (y[5] + y[7]);
+    }
+    g->ic1 = ic1;
+    g->ic2 = ic2;
+}
+
+// Resamples a voice's source clip into its pair of lanes, silent before
+// its onset and after its end. Returns false once the clip ends.
+static bool filter_fill(int slot, int voice, size_t frames, bool nearest) {
+    const float *planes[ENGINE_CHANNELS];
+    memcpy(planes, pool.clip[slot]->planes, sizeof(planes));
+    size_t length = pool.clip[slot]->length;
+    uint64_t position = pool.position[slot];
+    uint64_t increment = pool.increment[slot];
+    size_t onset = pool.offset[slot];
+    float *lanes = (float *)filter_in + voice * ENGINE_CHANNELS;
+    bool playing = true;
+    size_t i = 0;
+
+    for (; i < onset; i++) {
+        for (int c = 0; c < ENGINE_CHANNELS; c++) lanes[i * FILTER_LANES + c] = 0.0f;
+    }
+    if (nearest) position += VOICE_UNITY / 2;
+    for (; i < frames; i++) {
+        size_t index = (size_t)(position >> VOICE_FRAC_BITS);
+        if (index + 1 >= length) {
+            playing = false;
+            break;
+        }
+        float frac = nearest ? 0.0f : (float)(int64_t)(position & (VOICE_UNITY - 1)) * (1.0f / VOICE_UNITY);
+        for (int c = 0; c < ENGINE_CHANNELS; c++) {
+            float a = planes[c][index], b = planes[c][index + 1];
+            lanes[i * FILTER_LANES + c] = a + (b - a) * frac;
+        }
+        position += increment;
+    }
+    if (nearest && playing) position -= VOICE_UNITY / 2;
+    for (; i < frames; i++) {
+        for (int c = 0; c < ENGINE_CHANNELS; c++) lanes[i * FILTER_LANES + c] = 0.0f;
+    }
+    pool.position[slot] = position;
+    return playing;
+}
+
+// Mixes every active voice through its filter, FILTER_GROUP_VOICES at a
+// time. Returns false, leaving the bus untouched, when nothing plays.
+static bool mix_filter_voices(size_t frames) {
+    if (pool.active_count == 0) return false;
+
+    bool nearest = atomic_load_explicit(&degrade_level, memory_order_relaxed) >= 2;
+    bool playing[MAX_VOICES];
+    for (int c = 0; c < ENGINE_CHANNELS; c++) {
+        memset(bus[c], 0, frames * sizeof(float));
+    }
+
+    for (int first = 0; first < pool.active_count; first += FILTER_GROUP_VOICES) {
+        struct filter_group g;
+        memset(&g, 0, sizeof(g));
+        for (int v = 0; v < FILTER_GROUP_VOICES; v++) {
+            int k = first + v;
+            if (k >= pool.active_count) {
+                float *lanes = (float *)filter_in + v * ENGINE_CHANNELS;
+                for (size_t i = 0; i < frames; i++) {
+                    for (int c = 0; c < ENGINE_CHANNELS; c++) lanes[i * FILTER_LANES + c] = 0.0f;
+                }
+                continue;
+            }
+            int slot = pool.active[k];
+            playing[k] = filter_fill(slot, v, frames, nearest);
+            float a1 = pool.svf_a1[slot], a2 = pool.svf_a2[slot], a3 = pool.svf_a3[slot];
+            float gain = pool.gain[slot];
+            for (int c = 0; c < ENGINE_CHANNELS; c++) {
+                int lane = v * ENGINE_CHANNELS + c;
+                g.m11[lane] = 2.0f * a1 - 1.0f;
+                g.m12[lane] = -2.0f * a2;
+                g.b1[lane] = 2.0f * a2;
+                g.m21[lane] = 2.0f * a2;
+                g.m22[lane] = 1.0f - 2.0f * a3;
+                g.b2[lane] = 2.0f * a3;
+                g.c1[lane] = a2 * gain;
+                g.c2[lane] = (1.0f - a3) * gain;
+                g.c3[lane] = a3 * gain;
+                g.ic1[lane] = pool.svf_ic1[slot][c];
+                g.ic2[lane] = pool.svf_ic2[slot][c];
+            }
+        }
+
+        filter_group_run(&g, frames);
+
+        for (int v = 0; v < FILTER_GROUP_VOICES && first + v < pool.active_count; v++) {
+            int slot = pool.active[first + v];
+            for (int c = 0; c < ENGINE_CHANNELS; c++) {
+                pool.svf_ic1[slot][c] = g.ic1[v * ENGINE_CHANNELS + c];
+                pool.svf_ic2[slot][c] = g.ic2[v * ENGINE_CHANNELS + c];
+            }
+            pool.offset[slot] = 0;
+        }
+    }
+
+    for (int k = pool.active_count - 1; k >= 0; k--) {
+        if (playing[k]) continue;
+        int slot = pool.active[k];
+        pool.active[k] = pool.active[--pool.active_count];
+        pool.free[pool.free_count++] = (uint8_t)slot;
+    }
+    return true;
+}
+
+// Synthesized voices are mono, one per lane, FILTER_LANES at a time.
+// Pitch and envelope are computed once per period and ramped linearly
+// across it; lanes stay silent until their onset frame.
+typedef int32_t filter_ivec __attribute__((vector_size(FILTER_LANES * sizeof(int32_t))));
+typedef uint32_t filter_uvec __attribute__((vector_size(FILTER_LANES * sizeof(uint32_t))));
+
+struct synth_group {
+    filter_vec phase, inc, dinc;
+    filter_vec env, denv;
+    filter_vec open, open_inv, breath;
+    filter_vec a0[SYNTH_FORMANTS], b1[SYNTH_FORMANTS], b2[SYNTH_FORMANTS];
+    filter_vec y1[SYNTH_FORMANTS], y2[SYNTH_FORMANTS];
+    filter_ivec onset;
+    filter_uvec noise;
+};
+
+static float synth_envelope(double u) {
+    double attack = u / SYNTH_ATTACK, release = (1.0 - u) / SYNTH_RELEASE;
+    if (attack > 1.0) attack = 1.0;
+    if (release > 1.0) release = 1.0;
+    if (release < 0.0) release = 0.0;
+    return (float)(attack * release * release);
+}
+
+// Phase increment (cycles per frame) of a voice after `elapsed` frames:
+// the pitch swells over the first half, sags towards the end and carries
+// a light vibrato.
+static float synth_increment(int slot, uint32_t elapsed) {
+    double u = (double)elapsed / synth.length[slot];
+    double seconds = (double)elapsed / sample_rate;
+    double contour = 1.0 + 0.10 * sin(3.14159265358979323846 * u) - 0.12 * u;
+    double vibrato = 1.0 + 0.012 * sin(2.0 * 3.14159265358979323846 * SYNTH_VIBRATO_HZ * seconds);
+    return (float)(synth.f0[slot] * contour * vibrato / sample_rate);
+}
+
+// The excitation is the derivative of a polynomial (KLGLOTT88) glottal
+// flow pulse, x * (13.5 - 20.25 * x) over the open phase, which carries
+// the lip radiation tilt.
+FILTER_CLONES
+static void synth_group_run(struct synth_group *g, size_t frames) {
+    filter_vec phase = g->phase, inc = g->inc, env = g->env;
+    filter_vec y1[SYNTH_FORMANTS], y2[SYNTH_FORMANTS];
+    filter_uvec noise = g->noise;
+    filter_ivec frame = (filter_ivec){0};
+    memcpy(y1, g->y1, sizeof(y1));
+    memcpy(y2, g->y2, sizeof(y2));
+
+    for (size_t i = 0; i < frames; i++) {
+        filter_ivec gate = frame >= g->onset;
+        filter_vec x = phase * g->open_inv;
+        filter_vec pulse = x * (13.5f - 20.25f * x);
+        pulse = (filter_vec)((filter_ivec)pulse & (phase < g->open));
+        noise = noise * 1664525u + 1013904223u;
+        filter_vec breath = __builtin_convertvector((filter_ivec)noise, filter_vec) * (g->breath * (1.0f / 2147483648.0f));
+        filter_vec e = (filter_vec)((filter_ivec)(pulse + breath) & gate);
+
+        filter_vec out = (filter_vec){0};
+        for (int k = 0; k < SYNTH_FORMANTS; k++) {
+            filter_vec y = g->a0[k] * e + g->b1[k] * y1[k] + g->b2[k] * y2[k];
+            y2[k] = y1[k];
+            y1[k] = y;
+            out += y;
+        }
+        out *= env;
+        bus[0][i] += ((out[0] + out[1]) + (out[2] + out[3])) + ((out[4] + out[5]) + (out[6] + out[7]));
+
+        phase += inc;
+        phase -= (filter_vec)((filter_ivec)((filter_vec){0} + 1.0f) & (phase >= 1.0f));
+        inc += g->dinc;
+        env += g->denv;
+        frame += 1;
+    }
+
+    g->phase = phase;
+    g->noise = noise;
+    memcpy(g->y1, y1, sizeof(y1));
+    memcpy(g->y2, y2, sizeof(y2));
+}
+
+// Renders every active voice from the synthesizer. Returns false, leaving
+// the bus untouched, when nothing plays.
+static bool mix_synth_voices(size_t frames) {
+    if (pool.active_count == 0) return false;
+
+    bool playing[MAX_VOICES];
+    memset(bus[0], 0, frames * sizeof(float));
+
+    for (int first = 0; first < pool.active_count; first += FILTER_LANES) {
+        struct synth_group g;
+        memset(&g, 0, sizeof(g));
+        for (int lane = 0; lane < FILTER_LANES; lane++) {
+            int k = first + lane;
+            if (k >= pool.active_count) {
+                g.onset[lane] = (int32_t)frames;
+                continue;
+            }
+            int slot = pool.active[k];
+            uint32_t onset = pool.offset[slot];
+            uint32_t start = synth.elapsed[slot];
+            uint32_t end = start + (uint32_t)frames - onset;
+            if (end > synth.length[slot]) end = synth.length[slot];
+            float span = (float)(frames - onset);
+            float env0 = synth_envelope((double)start / synth.length[slot]) * pool.gain[slot] * SYNTH_OUTPUT_GAIN;
+            float env1 = synth_envelope((double)end / synth.length[slot]) * pool.gain[slot] * SYNTH_OUTPUT_GAIN;
+            float inc0 = synth_increment(slot, start), inc1 = synth_increment(slot, end);
+
+            g.denv[lane] = (env1 - env0) / span;
+            g.env[lane] = env0 - g.denv[lane] * onset;
+            g.dinc[lane] = (inc1 - inc0) / span;
+            g.inc[lane] = inc0 - g.dinc[lane] * onset;
+            g.phase[lane] = synth.phase[slot];
+            g.open[lane] = synth.open_quotient[slot];
+            g.open_inv[lane] = 1.0f / synth.open_quotient[slot];
+            g.breath[lane] = synth.breath[slot];
+            g.onset[lane] = (int32_t)onset;
+            g.noise[lane] = synth.noise[slot];
+            for (int f = 0; f < SYNTH_FORMANTS; f++) {
+                g.a0[f][lane] = synth.a0[f][slot];
+                g.b1[f][lane] = synth.b1[f][slot];
+                g.b2[f][lane] = synth.b2[f][slot];
+                g.y1[f][lane] = synth.y1[f][slot];
+                g.y2[f][lane] = synth.y2[f][slot];
+            }
+            synth.elapsed[slot] = end;
+            playing[k] = end < synth.length[slot];
+            pool.offset[slot] = 0;
+        }
+
+        synth_group_run(&g, frames);
+
+        for (int lane = 0; lane < FILTER_LANES && first + lane < pool.active_count; lane++) {
+            int slot = pool.active[first + lane];
+            synth.phase[slot] = g.phase[lane];
+            synth.noise[slot] = g.noise[lane];
+            for (int f = 0; f < SYNTH_FORMANTS; f++) {
+                synth.y1[f][slot] = g.y1[f][lane];
+                synth.y2[f][slot] = g.y2[f][lane];
+            }
+        }
+    }
+    memcpy(bus[1], bus[0], frames * sizeof(float));
+
+    for (int k = pool.active_count - 1; k >= 0; k--) {
+        if (playing[k]) continue;
+        int slot = pool.active[k];
+        pool.active[k] = pool.active[--pool.active_count];
+        pool.free[pool.free_count++] = (uint8_t)slot;
+    }
+    return true;
+}
+
+// Visits only the active list; a finished voice is swapped with the last
+// entry and its slot pushed back on the free stack. The first voice
+// covering the whole period is written with gain(), so the common
+// single-voice case never clears the bus. Returns false when nothing
+// was mixed.
+static bool mix_clip_voices(size_t frames) {
+    bool cleared = false;
+
+    for (int k = 0; k < pool.active_count;) {
+        int slot = pool.active[k];
+        const struct sample_clip *clip = pool.clip[slot];
+        size_t offset = pool.offset[slot];
+        size_t position = (size_t)(pool.position[slot] >> VOICE_FRAC_BITS);
+        size_t available = clip->length - position;
+        size_t room = frames - offset;
+        size_t count = available < room ? available : room;
+        bool unity = pool.increment[slot] == VOICE_UNITY;
+        bool playing;
+
+        if (unity && !cleared && offset == 0 && count == frames) {
+            for (int c = 0; c < ENGINE_CHANNELS; c++) {
+                kernels->gain(bus[c], clip->planes[c] + position, count, pool.gain[slot]);
+            }
+        } else if (!cleared) {
+            for (int c = 0; c < ENGINE_CHANNELS; c++) {
+                memset(bus[c], 0, frames * sizeof(float));
+            }
+        }
+
+        if (!unity) {
+            playing = mix_voice_resampled(slot, offset, frames);
+        } else {
+            if (cleared || offset != 0 || count != frames) {
+                if (clip->channels == 1) {
+                    kernels->pan(bus[0] + offset, bus[1] + offset, clip->planes[0] + position,
+                                 count, pool.gain[slot], pool.gain[slot]);
+                } else {
+                    for (int c = 0; c < ENGINE_CHANNELS; c++) {
+                        kernels->mix(bus[c] + offset, clip->planes[c] + position, count, pool.gain[slot]);
+                    }
+                }
+            }
+            pool.position[slot] += (uint64_t)count << VOICE_FRAC_BITS;
+            playing = position + count < clip->length;
+        }
+        cleared = true;
+        pool.offset[slot] = 0;
+
+        if (playing) {
+            k++;
+        } else {
+            pool.active[k] = pool.active[--pool.active_count];
+            pool.free[pool.free_count++] = (uint8_t)slot;
+        }
+    }
+    return cleared;
+}
+
+// Mixes the playing voices into the bus. Returns false, leaving the bus
+// untouched, when nothing was mixed.
+static bool mix_voices(size_t frames) {
+    bool cleared;
+    if (synth_render) {
+        cleared = mix_synth_voices(frames);
+    } else if (filter_render) {
+        cleared = mix_filter_voices(frames);
+    } else {
+        cleared = mix_clip_voices(frames);
+    }
+
+    atomic_store(&engine.active_voices, pool.active_count);
+    if (pool.active_count > atomic_load(&engine.peak_voices)) {
+        atomic_store(&engine.peak_voices, pool.active_count);
+    }
+    return cleared;
+}
+
+void mix_period(int16_t *out, size_t frames) {
+    if (!mix_voices(frames)) {
+        memset(out, 0, frames * ENGINE_CHANNELS * sizeof(int16_t));
+    } else {
+        kernels->to_s16(out, bus[0], bus[1], frames);
+    }
+}
+
+static bool voices_active(void) {
+    return pool.active_count > 0;
+}
+
+// Parks the render thread until the next trigger. Nothing is armed while
+// parked: no timer, no device I/O, just a condition variable wait. The
+// decision to go idle is taken before the stream is paused, so it is
+// checked again once no period can be rendered any more: a callback that
+// started a voice meanwhile has withdrawn idle_requested, and a trigger
+// may already be queued. Either way the stream is resumed at once.
+static void render_idle(void) {
+    struct timespec idle_start, idle_end;
+    clock_gettime(CLOCK_MONOTONIC, &idle_start);
+    backend->pause(true);
+
+    pthread_mutex_lock(&mutex);
+    if (!atomic_load(&idle_requested) || !trigger_queue_empty()) {
+        pthread_mutex_unlock(&mutex);
+        backend->pause(false);
+        if (debug.enabled) {
+            printf("DEBUG: Idle cancelled, sound started meanwhile\n");
+        }
+        return;
+    }
+    atomic_fetch_add(&engine.idle_entries, 1);
+    if (debug.enabled) {
+        printf("DEBUG: Playback idle after %ld ms without motion\n", idle_timeout_ms);
+    }
+    atomic_store(&render_sleeping, true);
+    while (running && trigger_queue_empty()) {
+        pthread_cond_wait(&cond, &mutex);
+        atomic_fetch_add(&engine.render_idle_wakeups, 1);
+    }
+    atomic_store(&render_sleeping, false);
+    pthread_mutex_unlock(&mutex);
+    if (atomic_load(&stats_started)) sem_post(&stats_wakeup);
+
+    backend->pause(false);
+    clock_gettime(CLOCK_MONOTONIC, &idle_end);
+    atomic_fetch_add(&engine.idle_ns, timespec_diff_us(&idle_end, &idle_start) * 1000L);
+    if (debug.enabled && running) {
+        printf("DEBUG: Playback resumed\n");
+    }
+}
+
+// Render-side state, touched only by whichever thread renders periods.
+static struct trigger pending_trigger;
+static bool have_pending_trigger = false;
+static bool pending_waiting = false;
+static struct timespec pending_wait_start;
+static struct timespec last_activity;
+static long onset_delay_peak = 0;
+static long onset_delay_previous = 0;
+static struct timespec onset_window_start;
+static struct timespec headroom_window_start;
+static long headroom_window_low = 0;
+static long headroom_window_worst = 0;
+static long headroom_window_max = 0;
+static long render_minor_baseline = -1;
+static long render_major_baseline = -1;
+
+// The kernel thread id of a callback backend's real-time thread, taken by
+// its first period and read by the render thread to count its faults.
+static atomic_int callback_tid = 0;
+
+// Accumulates the page faults the rendering thread took since the last
+// count. Reset the baselines whenever rendering may move to a new thread.
+static void count_render_faults(long minor, long major) {
+    if (render_minor_baseline >= 0 && minor > render_minor_baseline) {
+        atomic_fetch_add(&engine.render_minor_faults, minor - render_minor_baseline);
+    }
+    if (render_major_baseline >= 0 && major > render_major_baseline) {
+        atomic_fetch_add(&engine.render_major_faults, major - render_major_baseline);
+    }
+    render_minor_baseline = minor;
+    render_major_baseline = major;
+}
+
+// A push render thread counts its own faults after every period.
+static void count_own_faults(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) != 0) return;
+    count_render_faults(ru.ru_minflt, ru.ru_majflt);
+}
+
+// A real-time callback makes no system calls, so the render thread reads
+// the faults of the callback's thread from /proc instead: minflt and
+// majflt are the 10th and 12th fields, the 8th and 10th after the name.
+static void count_callback_faults(void) {
+    int tid = atomic_load(&callback_tid);
+    if (tid <= 0) return;
+
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    char *p = strrchr(buf, ')');
+    long minor, major;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %ld %*d %ld", &minor, &major) != 2) return;
+    count_render_faults(minor, major);
+}
+
+// Ends the wait of a lazily loaded level, started or superseded.
+static void end_pending_wait(const struct timespec *now) {
+    if (!pending_waiting) return;
+    atomic_fetch_add(&bank_stats.wait_ns, timespec_diff_us(now, &pending_wait_start) * 1000L);
+    pending_waiting = false;
+}
+
+// Where in the period being rendered a trigger must start so that it is
+// heard a fixed onset target after its event, rather than whenever the
+// render thread got to it. The target is the deepest device delay seen
+// over the last one to two ONSET_PEAK_WINDOW_MS windows plus one period,
+// so onsets hold still while the delay fluctuates but a single spike does
+// not delay them for the rest of the session. A
+// trigger already past its target starts at frame 0 and counts as jitter;
+// an offset of a whole period or more means it is not due yet.
+static long onset_offset(const struct trigger *t, size_t frames, const struct timespec *now) {
+    long delay = backend->delay ? backend->delay() : -1;
+    if (delay < 0) delay = backend->write ? buffer_frames : period_frames;
+    long elapsed_us = timespec_diff_us(now, &onset_window_start);
+    if (elapsed_us >= ONSET_PEAK_WINDOW_MS * 1000L) {
+        onset_delay_previous = elapsed_us < 2 * ONSET_PEAK_WINDOW_MS * 1000L ? onset_delay_peak : 0;
+        onset_delay_peak = 0;
+        onset_window_start = *now;
+    }
+    if (delay > onset_delay_peak) onset_delay_peak = delay;
+
+    long deepest = onset_delay_peak > onset_delay_previous ? onset_delay_peak : onset_delay_previous;
+    long target = deepest + (long)frames;
+    atomic_store_explicit(&onset_target_frames, target, memory_order_relaxed);
+
+    // Events stamped by another clock cannot be placed.
+    long age_us = timespec_diff_us(now, &t->time);
+    if (age_us < 0 || age_us > 1000000L) return 0;
+
+    long offset = target - delay - age_us * sample_rate / 1000000L;
+    if (offset < 0) {
+        latency_record(&onset_jitter, -offset * 1000000L / sample_rate);
+        return 0;
+    }
+    if (offset < (long)frames) latency_record(&onset_jitter, 0);
+    return offset;
+}
+
+// Finds this process's cgroup v2 CPU quota. Without one (or with "max")
+// only render headroom drives load shedding.
+static void degrade_open_cgroup(void) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return;
+
+    char line[PATH_MAX], path[PATH_MAX + 32];
+    bool found = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            found = true;
+            break;
+        }
+    }
+    fclose(f);
+    if (!found) return;
+
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+    f = fopen(path, "r");
+    if (!f) return;
+    char quota[32];
+    long period = 0;
+    int fields = fscanf(f, "%31s %ld", quota, &period);
+    fclose(f);
+    if (fields != 2 || strcmp(quota, "max") == 0 || period <= 0) return;
+
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.stat", line + 3);
+    degrade.cpu_stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (degrade.cpu_stat_fd < 0) return;
+    degrade.quota_cpus = atof(quota) / period;
+    if (debug.enabled) {
+        printf("DEBUG: CPU quota %.2f CPUs from %s\n", degrade.quota_cpus, path);
+    }
+}
+
+// Share of the cgroup CPU quota used since the last check, or -1.
+static double degrade_quota_used(const struct timespec *now) {
+    if (degrade.cpu_stat_fd < 0) return -1;
+
+    char buf[512];
+    ssize_t n = pread(degrade.cpu_stat_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    char *usage = strstr(buf, "usage_usec ");
+    if (!usage) return -1;
+    long usage_us = atol(usage + strlen("usage_usec "));
+
+    double used = -1;
+    long wall_us = timespec_diff_us(now, &degrade.last_check);
+    if (degrade.last_usage_us > 0 && wall_us > 0) {
+        used = (usage_us - degrade.last_usage_us) / (wall_us * degrade.quota_cpus);
+    }
+    degrade.last_usage_us = usage_us;
+    degrade.last_check = *now;
+    return used;
+}
+
+// Called once per headroom window, never from a real-time callback. One
+// window under pressure sheds one step; DEGRADE_CALM_WINDOWS calm windows
+// in a row restore one.
+void degrade_update(long worst_permille) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double headroom = 100.0 - worst_permille / 10.0;
+    double quota = degrade_quota_used(&now);
+    bool pressure = headroom < headroom_warn_pct || quota > DEGRADE_QUOTA_HIGH;
+    bool calm = headroom >= fmin(2.0 * headroom_warn_pct, 90.0) && quota < DEGRADE_QUOTA_LOW;
+
+    int level = atomic_load(&degrade_level);
+    int next = level;
+    if (pressure) {
+        degrade.calm_windows = 0;
+        if (level < DEGRADE_MAX_LEVEL) next = level + 1;
+    } else if (calm && level > 0) {
+        if (++degrade.calm_windows >= DEGRADE_CALM_WINDOWS) next = level - 1;
+    } else {
+        degrade.calm_windows = 0;
+    }
+    if (next == level) return;
+
+    degrade.level_us[level] += timespec_diff_us(&now, &degrade.level_since);
+    degrade.level_since = now;
+    degrade.calm_windows = 0;
+    atomic_store(&degrade_level, next);
+    if (next > level) {
+        degrade.steps_down++;
+        char quota_text[32] = "no CPU quota";
+        if (quota >= 0) snprintf(quota_text, sizeof(quota_text), "%.0f%% of CPU quota", quota * 100.0);
+        fprintf(stderr, "Warning: CPU pressure (headroom %.1f%%, %s), shedding load: %s\n",
+                headroom, quota_text, degrade_steps[next]);
+    } else {
+        degrade.steps_up++;
+        printf("CPU pressure eased, restoring %s\n", level == 1 ? "all voices" :
+               level == 2 ? "linear resampling" : "input aggregation");
+    }
+}
+
+void report_low_headroom(void) {
+    fprintf(stderr, "Warning: Render headroom fell below %g%% in %ld periods (worst %.1f%%), xruns are close\n",
+            headroom_warn_pct, atomic_load(&headroom_warn_count),
+            100.0 - atomic_load(&headroom_warn_worst) / 10.0);
+}
+
+// The clock a period's render time is charged by. Reading the thread CPU
+// clock is a system call, so real-time callbacks use the monotonic clock,
+// which the vDSO serves and which matches while the thread runs unpreempted.
+static inline void budget_clock(struct timespec *t) {
+    clock_gettime(backend->write ? CLOCK_THREAD_CPUTIME_ID : CLOCK_MONOTONIC, t);
+}
+
+// Charges the render time of one period against the period's duration.
+// Push backends warn from the render thread; a real-time callback only
+// raises flags, which the render thread polls.
+static void budget_record(const struct timespec *cpu_start, size_t frames, const struct timespec *now) {
+    struct timespec cpu_end;
+    budget_clock(&cpu_end);
+    long cpu_ns = timespec_diff_us(&cpu_end, cpu_start) * 1000L;
+    long period_ns = (long)(frames * 1000000000LL / sample_rate);
+    long permille = period_ns > 0 ? cpu_ns * 1000L / period_ns : 0;
+    load_record(&render_load, permille);
+
+    if (100.0 - permille / 10.0 < headroom_warn_pct) {
+        atomic_fetch_add(&low_headroom_periods, 1);
+        headroom_window_low++;
+        if (permille > headroom_window_worst) headroom_window_worst = permille;
+    }
+    if (permille > headroom_window_max) headroom_window_max = permille;
+    if (timespec_diff_us(now, &headroom_window_start) < HEADROOM_WINDOW_MS * 1000L) return;
+
+    bool warn = headroom_window_low > 0 && !atomic_load(&headroom_warning_pending);
+    if (warn) {
+        atomic_store(&headroom_warn_count, headroom_window_low);
+        atomic_store(&headroom_warn_worst, headroom_window_worst);
+    }
+    if (backend->write) {
+        if (warn) report_low_headroom();
+        degrade_update(headroom_window_max);
+        if (backend->xruns) atomic_store(&engine.xruns, backend->xruns());
+    } else {
+        if (warn) atomic_store(&headroom_warning_pending, true);
+        atomic_store(&pressure_window_worst, headroom_window_max);
+        atomic_store(&pressure_check_pending, true);
+    }
+    headroom_window_start = *now;
+    headroom_window_low = 0;
+    headroom_window_worst = 0;
+    headroom_window_max = 0;
+}
+
+// The part of a period before the mix: starts the newest trigger if a
+// voice is free. Returns false once the engine has been quiet for the
+// idle timeout.
+static bool engine_begin_period(size_t frames, const struct timespec *now) {
+    struct trigger newest;
+    if (take_newest_trigger(&newest)) {
+        end_pending_wait(now);
+        pending_trigger = newest;
+        have_pending_trigger = true;
+    }
+
+    // A lazily loaded level may still be decoding; hold the trigger until
+    // it is ready, or drop it if the level failed to load.
+    if (have_pending_trigger && !no_sound && !synth_render) {
+        int state = atomic_load_explicit(&bank_state[clip_source[pending_trigger.level]], memory_order_acquire);
+        if (state == LEVEL_FAILED) {
+            end_pending_wait(now);
+            have_pending_trigger = false;
+        } else if (state != LEVEL_READY) {
+            if (!pending_waiting) {
+                pending_waiting = true;
+                pending_wait_start = *now;
+                atomic_fetch_add(&bank_stats.waits, 1);
+            }
+        } else {
+            end_pending_wait(now);
+        }
+    }
+
+    bool active = voices_active();
+    if (have_pending_trigger && !pending_waiting) {
+        bool slot_free = voice_available();
+        long offset = slot_free ? onset_offset(&pending_trigger, frames, now) : (long)frames;
+        if (offset < (long)frames) {
+            start_voice(&pending_trigger, (size_t)offset);
+            have_pending_trigger = false;
+            active = true;
+        }
+    }
+
+    if (active || have_pending_trigger) {
+        last_activity = *now;
+    } else if (timespec_diff_us(now, &last_activity) >= idle_timeout_ms * 1000L) {
+        return false;
+    }
+    return true;
+}
+
+static void engine_end_period(const struct timespec *cpu_start, size_t frames, const struct timespec *now) {
+    atomic_fetch_add_explicit(&engine.frames_rendered, (long)frames, memory_order_relaxed);
+    if (backend->write) count_own_faults();
+    budget_record(cpu_start, frames, now);
+}
+
+// The --tee outputs of a callback backend: its real-time thread only
+// copies each period in here, and the render thread feeds the sinks from
+// it, so the sinks' semaphores and eventfds are never signalled from the
+// callback. A period that does not fit is dropped for every sink.
+static int16_t tee_staging[TEE_STAGING_FRAMES * ENGINE_CHANNELS];
+static atomic_size_t tee_staging_head = 0;
+static atomic_size_t tee_staging_tail = 0;
+
+static void tee_stage(const int16_t *frames, size_t count) {
+    size_t head = atomic_load_explicit(&tee_staging_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&tee_staging_tail, memory_order_acquire);
+    if (TEE_STAGING_FRAMES - (head - tail) < count) {
+        for (int i = 0; i < sink_count; i++) {
+            atomic_fetch_add_explicit(&sinks[i].frames_dropped, (long)count, memory_order_relaxed);
+        }
+        return;
+    }
+
+    size_t at = head & (TEE_STAGING_FRAMES - 1);
+    size_t first = TEE_STAGING_FRAMES - at < count ? TEE_STAGING_FRAMES - at : count;
+    memcpy(tee_staging + at * ENGINE_CHANNELS, frames, first * ENGINE_CHANNELS * sizeof(int16_t));
+    memcpy(tee_staging, frames + first * ENGINE_CHANNELS, (count - first) * ENGINE_CHANNELS * sizeof(int16_t));
+    atomic_store_explicit(&tee_staging_head, head + count, memory_order_release);
+}
+
+// Called by the render thread; hands everything staged on to the sinks.
+static void tee_drain(void) {
+    size_t tail = atomic_load_explicit(&tee_staging_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&tee_staging_head, memory_order_acquire);
+    while (tail != head) {
+        size_t at = tail & (TEE_STAGING_FRAMES - 1);
+        size_t count = TEE_STAGING_FRAMES - at < head - tail ? TEE_STAGING_FRAMES - at : head - tail;
+        if (count > MAX_PERIOD_FRAMES) count = MAX_PERIOD_FRAMES;
+        sinks_feed(tee_staging + at * ENGINE_CHANNELS, count);
+        tail += count;
+    }
+    atomic_store_explicit(&tee_staging_tail, tail, memory_order_release);
+}
+
+// Push backends feed the sinks directly; callbacks stage the period.
+static void engine_tee(const int16_t *frames, size_t count) {
+    if (sink_count == 0) return;
+    if (backend->write) {
+        sinks_feed(frames, count);
+    } else {
+        tee_stage(frames, count);
+    }
+}
+
+// Produces one period: starts the newest trigger if a voice is free, then
+// mixes. Returns false without rendering once the engine has been quiet
+// for the idle timeout.
+bool engine_render(int16_t *out, size_t frames) {
+    struct timespec cpu_start, now;
+    budget_clock(&cpu_start);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!engine_begin_period(frames, &now)) return false;
+
+    mix_period(out, frames);
+    engine_tee(out, frames);
+    engine_end_period(&cpu_start, frames, &now);
+    return true;
+}
+
+// Converted from the float planes only for the --tee outputs.
+static int16_t sink_period[MAX_PERIOD_FRAMES * ENGINE_CHANNELS];
+
+// engine_render() for backends that take float planes: the voices are
+// mixed straight into left and right.
+static bool engine_render_float(float *left, float *right, size_t frames) {
+    struct timespec cpu_start, now;
+    budget_clock(&cpu_start);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!engine_begin_period(frames, &now)) return false;
+
+    bus[0] = left;
+    bus[1] = right;
+    bool cleared = mix_voices(frames);
+    bus[0] = bus_storage[0];
+    bus[1] = bus_storage[1];
+    if (!cleared) {
+        memset(left, 0, frames * sizeof(float));
+        memset(right, 0, frames * sizeof(float));
+    }
+    if (sink_count > 0) {
+        kernels->to_s16(sink_period, left, right, frames);
+        engine_tee(sink_period, frames);
+    }
+    engine_end_period(&cpu_start, frames, &now);
+    return true;
+}
+
+// The render thread sees the request on its next poll.
+static void engine_request_idle(void) {
+    if (!atomic_load_explicit(&idle_requested, memory_order_relaxed)) {
+        atomic_store(&idle_requested, true);
+    }
+}
+
+// Remembers which thread the callback runs on, once per stream, for
+// count_callback_faults().
+static inline void engine_note_callback_thread(void) {
+    if (atomic_load_explicit(&callback_tid, memory_order_relaxed) == 0) {
+        atomic_store(&callback_tid, (int)gettid());
+    }
+}
+
+// A callback that rendered sound after asking to go idle takes the
+// request back, so render_idle() does not pause a playing voice.
+static inline void engine_withdraw_idle(void) {
+    if (atomic_load_explicit(&idle_requested, memory_order_relaxed)) {
+        atomic_store(&idle_requested, false);
+    }
+}
+
+// Entry point for callback-driven backends, called from their process
+// callback. Always fills the buffer; when the engine goes quiet it asks
+// the render thread to pause the stream.
+void engine_render_callback(int16_t *out, size_t frames) {
+    atomic_fetch_add(&engine.render_wakeups, 1);
+    engine_note_callback_thread();
+    if (engine_render(out, frames)) {
+        engine_withdraw_idle();
+        return;
+    }
+
+    memset(out, 0, frames * ENGINE_CHANNELS * sizeof(int16_t));
+    engine_request_idle();
+}
+
+// The same for backends that take float planes.
+void engine_render_float_callback(float *left, float *right, size_t frames) {
+    atomic_fetch_add(&engine.render_wakeups, 1);
+    engine_note_callback_thread();
+    if (engine_render_float(left, right, frames)) {
+        engine_withdraw_idle();
+        return;
+    }
+
+    memset(left, 0, frames * sizeof(float));
+    memset(right, 0, frames * sizeof(float));
+    engine_request_idle();
+}
+
+// Called from a callback-driven backend's own threads when its stream
+// dies; the render thread picks the failure up and reopens the output.
+void engine_output_failed(void) {
+    if (!atomic_exchange(&output_failed, true)) {
+        sem_post(&idle_request);
+    }
+}
+
+static long recovery_backoff_ms = RECOVERY_MIN_BACKOFF_MS;
+static struct timespec recovered_at;
+
+// Closes the failed output and reopens it with exponential backoff. The
+// reader is never blocked: while the output is down engine_trigger()
+// drops and counts triggers instead of queueing them, and the sounds that
+// were playing are abandoned. Some outputs (aplay) only fail on the first
+// write after reopening, so the backoff keeps growing until the output
+// has stayed up for RECOVERY_STABLE_MS.
+static void render_recover(void) {
+    atomic_store(&output_down, true);
+    atomic_fetch_add(&engine.device_errors, 1);
+    fprintf(stderr, "Error: Audio output '%s' failed, reopening\n", backend->name);
+
+    struct timespec outage_start, outage_end;
+    clock_gettime(CLOCK_MONOTONIC, &outage_start);
+    backend->close();
+
+    reset_voice_pool();
+    have_pending_trigger = false;
+    pending_waiting = false;
+    onset_delay_peak = 0;
+    onset_delay_previous = 0;
+    render_minor_baseline = -1;
+    render_major_baseline = -1;
+    atomic_store(&callback_tid, 0);
+
+    if (recovered_at.tv_sec != 0 &&
+        timespec_diff_us(&outage_start, &recovered_at) < RECOVERY_STABLE_MS * 1000L) {
+        recovery_backoff_ms = recovery_backoff_ms * 2 > RECOVERY_MAX_BACKOFF_MS ?
+                              RECOVERY_MAX_BACKOFF_MS : recovery_backoff_ms * 2;
+    } else {
+        recovery_backoff_ms = RECOVERY_MIN_BACKOFF_MS;
+    }
+
+    long backoff_ms = recovery_backoff_ms;
+    bool reopened = false;
+    while (running && !reopened) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += backoff_ms / 1000;
+        deadline.tv_nsec += (backoff_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            deadline.tv_sec++;
+        }
+
+        pthread_mutex_lock(&mutex);
+        while (running && pthread_cond_timedwait(&cond, &mutex, &deadline) != ETIMEDOUT) {
+        }
+        pthread_mutex_unlock(&mutex);
+        if (!running) break;
+
+        atomic_fetch_add(&engine.reopen_attempts, 1);
+        atomic_store(&output_failed, false);
+        reopened = backend->open();
+        if (!reopened) {
+            backoff_ms = backoff_ms * 2 > RECOVERY_MAX_BACKOFF_MS ? RECOVERY_MAX_BACKOFF_MS : backoff_ms * 2;
+            recovery_backoff_ms = backoff_ms;
+            if (debug.enabled) {
+                printf("DEBUG: Reopening '%s' failed, next attempt in %ld ms\n", backend->name, backoff_ms);
+            }
+        }
+    }
+
+    // Anything queued before the outage is stale by now.
+    struct trigger stale;
+    take_newest_trigger(&stale);
+    atomic_store(&output_down, false);
+
+    clock_gettime(CLOCK_MONOTONIC, &outage_end);
+    recovered_at = outage_end;
+    long outage_us = timespec_diff_us(&outage_end, &outage_start);
+    atomic_fetch_add(&engine.outage_ns, outage_us * 1000L);
+    clock_gettime(CLOCK_MONOTONIC, &last_activity);
+    if (reopened) {
+        fprintf(stderr, "Audio output '%s' reopened after %ld ms\n", backend->name, outage_us / 1000);
+    }
+}
+
+static void tuner_reset_window(void) {
+    tuner.window_frames = 0;
+    tuner.window_max_render_us = 0;
+    tuner.window_start_xruns = backend->xruns();
+}
+
+static void tuner_apply(int step, long xruns, double load) {
+    struct latency_adjustment *a = &tuner.history[tuner.adjustments % ADAPT_HISTORY];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    a->at = timespec_diff_us(&now, &engine_start_time) / 1e6;
+    a->from = tuner.step;
+    a->to = step;
+    a->xruns = xruns;
+    a->load = load;
+    tuner.adjustments++;
+
+    if (debug.enabled) {
+        printf("DEBUG: Latency tuning: period %d -> %d, buffer %d -> %d frames (%ld xruns, render load %.0f%%)\n",
+               latency_steps[tuner.step].period, latency_steps[step].period,
+               latency_steps[tuner.step].buffer, latency_steps[step].buffer, xruns, load * 100.0);
+    }
+
+    tuner.step = step;
+    tuner.clean_windows = 0;
+    period_frames = latency_steps[step].period;
+    buffer_frames = latency_steps[step].buffer;
+    onset_delay_peak = 0;
+    onset_delay_previous = 0;
+    backend->close();
+    if (!backend->open()) {
+        render_recover();
+    }
+    tuner_reset_window();
+}
+
+// Called after every period written. Render load is the worst render time
+// in the window relative to the period duration.
+static void tuner_update(long render_us) {
+    tuner.window_frames += period_frames;
+    if (render_us > tuner.window_max_render_us) tuner.window_max_render_us = render_us;
+    if (tuner.window_frames < (long)sample_rate * ADAPT_WINDOW_MS / 1000) return;
+
+    long xruns = backend->xruns() - tuner.window_start_xruns;
+    double period_us = latency_steps[tuner.step].period * 1e6 / sample_rate;
+    double load = tuner.window_max_render_us / period_us;
+
+    if (xruns > 0 || load > ADAPT_MAX_RENDER_LOAD) {
+        tuner.failures[tuner.step]++;
+        tuner.clean_windows = 0;
+        if (tuner.step + 1 < NUM_LATENCY_STEPS) {
+            tuner_apply(tuner.step + 1, xruns, load);
+            return;
+        }
+    } else if (++tuner.clean_windows >= ADAPT_STABLE_WINDOWS && tuner.step > 0 &&
+               tuner.failures[tuner.step - 1] < ADAPT_MAX_STEP_FAILURES) {
+        double lower_period_us = latency_steps[tuner.step - 1].period * 1e6 / sample_rate;
+        if (tuner.window_max_render_us < lower_period_us * ADAPT_STEP_DOWN_LOAD) {
+            tuner_apply(tuner.step - 1, xruns, load);
+            return;
+        }
+    }
+    tuner_reset_window();
+}
+
+// With a push backend this thread renders and writes every period. With a
+// callback-driven backend rendering happens in the backend's own thread,
+// which only raises flags and bumps counters. This one polls them, every
+// period while there are --tee outputs to feed and every CALLBACK_POLL_MS
+// otherwise, and does the work that must not run in the process callback:
+// feeding the sinks, counting faults, warnings, idle pause/resume and
+// failure recovery. While idle it is parked and does not poll.
+void *render_thread(void *unused) {
+    (void)unused;
+
+    int16_t period[MAX_PERIOD_FRAMES * ENGINE_CHANNELS];
+    memset(period, 0, sizeof(period));
+    clock_gettime(CLOCK_MONOTONIC, &last_activity);
+
+    if (!backend->write) {
+        while (running) {
+            long poll_ns = sink_count > 0 ? (long)(period_frames * 1000000000LL / sample_rate)
+                                          : CALLBACK_POLL_MS * 1000000L;
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += poll_ns;
+            while (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_nsec -= 1000000000L;
+                deadline.tv_sec++;
+            }
+            while (sem_timedwait(&idle_request, &deadline) != 0 && errno == EINTR) {
+            }
+            if (!running) break;
+            tee_drain();
+            count_callback_faults();
+            if (atomic_exchange(&headroom_warning_pending, false)) {
+                report_low_headroom();
+            }
+            if (atomic_exchange(&pressure_check_pending, false)) {
+                degrade_update(atomic_load(&pressure_window_worst));
+            }
+            if (atomic_load(&output_failed)) {
+                render_recover();
+                atomic_store(&idle_requested, false);
+            } else if (atomic_load(&idle_requested)) {
+                render_idle();
+                atomic_store(&idle_requested, false);
+                clock_gettime(CLOCK_MONOTONIC, &last_activity);
+            }
+        }
+        return NULL;
+    }
+
+    bool tuning = adaptive_latency && backend->xruns;
+    if (tuning) tuner_reset_window();
+
+    while (running) {
+        struct timespec render_start, render_end;
+        clock_gettime(CLOCK_MONOTONIC, &render_start);
+        if (!engine_render(period, (size_t)period_frames)) {
+            atomic_store(&idle_requested, true);
+            render_idle();
+            atomic_store(&idle_requested, false);
+            clock_gettime(CLOCK_MONOTONIC, &last_activity);
+            // The device was stopped; the idle gap is not part of the window.
+            if (tuning) tuner_reset_window();
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &render_end);
+
+        if (!backend->write(period, (size_t)period_frames)) {
+            if (running) render_recover();
+            if (tuning) tuner_reset_window();
+            continue;
+        }
+        atomic_fetch_add(&engine.render_wakeups, 1);
+        if (tuning) tuner_update(timespec_diff_us(&render_end, &render_start));
+    }
+    return NULL;
+}
+
+// Cumulative counters as the series thread last saw them.
+struct series_totals {
+    long events;
+    long frames;
+    long triggers[NUM_INTENSITY_LEVELS + 1];
+    long drops;
+    long xruns;
+    struct latency_histogram latency;
+};
+
+static void series_sample(struct series_totals *t) {
+    t->events = atomic_load(&engine.input_events);
+    t->frames = atomic_load(&engine.frames_rendered);
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        t->triggers[level] = atomic_load(&engine.level_triggers[level]);
+    }
+    t->drops = atomic_load(&engine.triggers_dropped) +
+               atomic_load(&engine.triggers_dropped_outage) +
+               atomic_load(&engine.triggers_skipped_loading);
+    t->xruns = atomic_load(&engine.xruns);
+    latency_snapshot(&t->latency, &trigger_latency);
+}
+
+// Appends the row for one second, overwriting the oldest once the ring is
+// full. Without totals the row records a second with no activity.
+static void series_push(int64_t time, const struct series_totals *now, const struct series_totals *last) {
+    struct series_row *row = &series[series_rows % SERIES_SECONDS];
+    memset(row, 0, sizeof(*row));
+    row->time = time;
+    if (now) {
+        row->events = (uint32_t)(now->events - last->events);
+        row->frames = (uint32_t)(now->frames - last->frames);
+        for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+            row->triggers[level] = (uint32_t)(now->triggers[level] - last->triggers[level]);
+        }
+        row->drops = (uint32_t)(now->drops - last->drops);
+        row->xruns = (uint32_t)(now->xruns - last->xruns);
+
+        struct latency_histogram window = now->latency;
+        latency_window(&window, &last->latency);
+        row->p99_us = (uint32_t)latency_percentile(&window, 99.0);
+    }
+    series_rows++;
+}
+
+// Writes the ring as CSV, oldest row first. The dump goes to a temporary
+// file that is renamed over series_path, so readers never see half of one.
+static void series_dump(void) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", series_path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "Warning: Cannot write time series to %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "time,events,frames");
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        fprintf(f, ",triggers_%d", level);
+    }
+    fprintf(f, ",drops,xruns,p99_latency_us\n");
+
+    unsigned long first = series_rows > SERIES_SECONDS ? series_rows - SERIES_SECONDS : 0;
+    for (unsigned long r = first; r < series_rows; r++) {
+        const struct series_row *row = &series[r % SERIES_SECONDS];
+        fprintf(f, "%lld,%u,%u", (long long)row->time, row->events, row->frames);
+        for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+            fprintf(f, ",%u", row->triggers[level]);
+        }
+        fprintf(f, ",%u,%u,%u\n", row->drops, row->xruns, row->p99_us);
+    }
+
+    if (fclose(f) != 0 || rename(tmp, series_path) != 0) {
+        fprintf(stderr, "Warning: Cannot write time series to %s: %s\n", series_path, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    if (debug.enabled) {
+        printf("DEBUG: Wrote %lu seconds of time series to %s\n", series_rows - first, series_path);
+    }
+}
+
+// Maps the stats file, creating it if it does not exist, and keeps what
+// it holds as the base that this session's counts are added to.
+static bool stats_file_open(void) {
+    int fd = open(stats_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open stats file %s: %s\n", stats_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Cannot stat stats file %s: %s\n", stats_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    bool fresh = st.st_size == 0;
+    if (!fresh && st.st_size != (off_t)sizeof(struct stats_file)) {
+        fprintf(stderr, "Error: %s is not a stats file of this version\n", stats_path);
+        close(fd);
+        return false;
+    }
+    if (fresh && ftruncate(fd, sizeof(struct stats_file)) != 0) {
+        fprintf(stderr, "Error: Cannot size stats file %s: %s\n", stats_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    void *p = mmap(NULL, sizeof(struct stats_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map stats file %s: %s\n", stats_path, strerror(errno));
+        return false;
+    }
+    struct stats_file *f = p;
+
+    if (fresh) {
+        memcpy(f->magic, STATS_FILE_MAGIC, sizeof(f->magic));
+        f->size = sizeof(struct stats_file);
+        f->levels = NUM_INTENSITY_LEVELS;
+    } else if (memcmp(f->magic, STATS_FILE_MAGIC, sizeof(f->magic)) != 0 ||
+               f->size != sizeof(struct stats_file) || f->levels != NUM_INTENSITY_LEVELS) {
+        fprintf(stderr, "Error: %s is not a stats file of this version\n", stats_path);
+        munmap(p, sizeof(struct stats_file));
+        return false;
+    }
+
+    // A crash in the middle of an update leaves the sequence odd; the
+    // counts are at most one update stale, so just even it out.
+    f->sequence &= ~(uint64_t)1;
+    stats_base = *f;
+    stats_map = f;
+    if (debug.enabled) {
+        printf("DEBUG: Stats file %s: %s, %lld earlier sessions\n", stats_path,
+               fresh ? "created" : "resumed", (long long)stats_base.sessions);
+    }
+    return true;
+}
+
+static void stats_merge_latency(int64_t *buckets, int64_t *count, int64_t *max_us,
+                                const int64_t *base, int64_t base_count, int64_t base_max,
+                                const struct latency_histogram *h) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) buckets[i] = base[i] + h->buckets[i];
+    *count = base_count + h->count;
+    *max_us = h->max_us > base_max ? h->max_us : base_max;
+}
+
+// Rewrites the file in place from one sample of the counters. The sequence
+// is odd for the duration, like a seqlock, so readers can tell a torn read.
+static void stats_file_update(const struct series_totals *t) {
+    struct stats_file *f = stats_map;
+    const struct stats_file *b = &stats_base;
+    uint64_t sequence = f->sequence;
+    __atomic_store_n(&f->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    f->sessions = b->sessions + 1;
+    f->updated = (int64_t)time(NULL);
+    f->runtime_ms = b->runtime_ms + timespec_diff_us(&now, &engine_start_time) / 1000;
+    f->input_events = b->input_events + t->events;
+    f->frames_rendered = b->frames_rendered + t->frames;
+    f->drops = b->drops + t->drops;
+    f->xruns = b->xruns + t->xruns;
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) {
+        f->level_triggers[level] = b->level_triggers[level] + t->triggers[level];
+    }
+
+    stats_merge_latency(f->trigger_latency, &f->trigger_latency_count, &f->trigger_latency_max_us,
+                        b->trigger_latency, b->trigger_latency_count, b->trigger_latency_max_us,
+                        &t->latency);
+    struct latency_histogram delay;
+    latency_snapshot(&delay, &reader_delay);
+    stats_merge_latency(f->reader_delay, &f->reader_delay_count, &f->reader_delay_max_us,
+                        b->reader_delay, b->reader_delay_count, b->reader_delay_max_us, &delay);
+
+    for (int i = 0; i < LOAD_BUCKETS; i++) {
+        f->render_load[i] = b->render_load[i] + __atomic_load_n(&render_load.buckets[i], __ATOMIC_RELAXED);
+    }
+    f->render_load_count = b->render_load_count + __atomic_load_n(&render_load.count, __ATOMIC_RELAXED);
+    long max_permille = __atomic_load_n(&render_load.max_permille, __ATOMIC_RELAXED);
+    f->render_load_max_permille = max_permille > b->render_load_max_permille ?
+                                  max_permille : b->render_load_max_permille;
+
+    __atomic_store_n(&f->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void stats_file_close(void) {
+    struct series_totals t;
+    series_sample(&t);
+    stats_file_update(&t);
+    msync(stats_map, sizeof(struct stats_file), MS_SYNC);
+    munmap(stats_map, sizeof(struct stats_file));
+    stats_map = NULL;
+}
+
+// Samples the counters on one-second ticks of the monotonic clock, keeps
+// the time series and the stats file, and serves dump requests. After a
+// quiet second while the render thread is asleep it blocks until playback
+// resumes or a dump is requested, and then back-fills the seconds it
+// missed.
+static void *stats_thread(void *arg) {
+    (void)arg;
+    struct series_totals last, now;
+    struct timespec tick;
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    int64_t wall = (int64_t)time(NULL);
+    bool parked = false;
+    series_sample(&last);
+
+    while (running) {
+        if (parked) {
+            while (sem_wait(&stats_wakeup) != 0 && errno == EINTR) {
+            }
+        } else {
+            struct timespec mono, deadline;
+            clock_gettime(CLOCK_MONOTONIC, &mono);
+            long remaining_us = 1000000L - timespec_diff_us(&mono, &tick);
+            if (remaining_us < 0) remaining_us = 0;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += remaining_us / 1000000L;
+            deadline.tv_nsec += (remaining_us % 1000000L) * 1000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_nsec -= 1000000000L;
+                deadline.tv_sec++;
+            }
+            while (sem_timedwait(&stats_wakeup, &deadline) != 0 && errno == EINTR) {
+            }
+        }
+        if (!running) break;
+
+        struct timespec mono;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        long due = timespec_diff_us(&mono, &tick) / 1000000L;
+        if (due > 0) {
+            long gap = due - 1 < SERIES_SECONDS ? due - 1 : SERIES_SECONDS;
+            for (long k = due - gap; k < due; k++) {
+                series_push(wall + k, NULL, NULL);
+            }
+            series_sample(&now);
+            series_push(wall + due, &now, &last);
+            if (stats_map) stats_file_update(&now);
+            parked = now.events == last.events && now.frames == last.frames &&
+                     atomic_load(&render_sleeping);
+            last = now;
+            tick.tv_sec += due;
+            wall += due;
+        }
+
+        if (atomic_exchange(&series_dump_requested, false)) series_dump();
+    }
+    return NULL;
+}
+
+bool engine_start(void) {
+    backend = find_backend(no_sound ? "null" : backend_name);
+    if (!backend) {
+        fprintf(stderr, "Error: Unknown audio backend '%s'\n", backend_name);
+        return false;
+    }
+
+    if (adaptive_latency && !backend->xruns) {
+        fprintf(stderr, "Warning: Backend '%s' does not report xruns, adaptive latency disabled\n",
+                backend->name);
+        adaptive_latency = false;
+    }
+    if (adaptive_latency) {
+        period_frames = latency_steps[0].period;
+        buffer_frames = latency_steps[0].buffer;
+    }
+
+    // Backends may adopt the device's rate, so the bank is converted
+    // only once the output is open. Levels become playable one by one as
+    // the loaders publish them.
+    if (!backend->open()) {
+        fprintf(stderr, "Error: Failed to open audio backend '%s'\n", backend->name);
+        return false;
+    }
+    startup_mark("Backend '%s' open at %d Hz", backend->name, sample_rate);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (!no_sound && !synth_render && !load_sound_bank(sound_directory)) {
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        backend->close();
+        return false;
+    }
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    // The mix bus is first written by the render thread; fault it in
+    // here so that does not show up as render-thread page faults.
+    memset(bus_storage, 0, sizeof(bus_storage));
+    reset_voice_pool();
+    if (lock_bank && mlock(bus_storage, sizeof(bus_storage)) != 0 && debug.enabled) {
+        printf("DEBUG: Cannot lock mix bus: %s\n", strerror(errno));
+    }
+    kernels = select_mix_kernels();
+    if (debug.enabled) {
+        printf("DEBUG: Using %s mix kernels\n", kernels->name);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &engine_start_time);
+    degrade_open_cgroup();
+    degrade.level_since = engine_start_time;
+    sem_init(&idle_request, 0, 0);
+    sinks_start();
+    event_stream_start();
+
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    int err = pthread_create(&render_thread_id, NULL, render_thread, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (err != 0) {
+        fprintf(stderr, "Error: Failed to create render thread: %s\n", strerror(err));
+        sinks_stop();
+        event_stream_stop();
+        backend->close();
+        wait_sound_bank();
+        free_sound_bank();
+        return false;
+    }
+    startup_mark("Render thread running");
+
+    if (series_path || stats_map) {
+        sem_init(&stats_wakeup, 0, 0);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+        err = pthread_create(&stats_thread_id, NULL, stats_thread, NULL);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        if (err != 0) {
+            fprintf(stderr, "Warning: Failed to create stats thread: %s\n", strerror(err));
+        } else {
+            atomic_store(&stats_started, true);
+            if (series_path) signal(SIGUSR1, handle_signal);
+        }
+    }
+    return true;
+}
+
+void engine_stop(void) {
+    pthread_mutex_lock(&mutex);
+    running = false;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    sem_post(&idle_request);
+
+    pthread_join(render_thread_id, NULL);
+    if (atomic_load(&stats_started)) {
+        signal(SIGUSR1, SIG_IGN);
+        sem_post(&stats_wakeup);
+        pthread_join(stats_thread_id, NULL);
+        atomic_store(&stats_started, false);
+    }
+    if (stats_map) stats_file_close();
+    sinks_stop();
+    event_stream_stop();
+    backend->close();
+    wait_sound_bank();
+    free_sound_bank();
+    if (degrade.cpu_stat_fd >= 0) {
+        close(degrade.cpu_stat_fd);
+        degrade.cpu_stat_fd = -1;
+    }
+}
+
+// Reader-side aggregation window state.
+static int aggregate_dx = 0;
+static int aggregate_dy = 0;
+static bool aggregating = false;
+static struct timespec aggregate_start;
+static int aggregate_source = 0;
+
+// With --aggregate-ms auto, the window sums the reports of a fast device
+// into about one report of a 125 Hz one, so the intensity thresholds see
+// the same motion per trigger whatever the polling rate. Nothing is
+// summed until the rate estimate has settled.
+static long auto_aggregate_us(void) {
+    if (!fastest_rate) return 0;
+    if (fastest_rate->interval_us >= AUTO_AGGREGATE_REFERENCE_US) return 0;
+    return AUTO_AGGREGATE_REFERENCE_US - lround(fastest_rate->interval_us);
+}
+
+// Without --aggregate-ms every motion event triggers on its own. With it,
+// motion is summed until the window has passed and triggers once, stamped
+// with the last event; shedding load widens the window to at least
+// DEGRADED_AGGREGATE_MS. The trigger is credited to the device that
+// reported last.
+void process_event(const struct input_event *ev, int source) {
+    struct report_rate *rate = &sources[source].rate;
+    struct timespec time = {
+        .tv_sec = ev->input_event_sec,
+        .tv_nsec = ev->input_event_usec * 1000L,
+    };
+
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+        bool settled = rate->intervals >= REPORT_RATE_SETTLED;
+        report_rate_update(rate, &time);
+        if (rate->intervals < REPORT_RATE_SETTLED) return;
+        if (!fastest_rate || fastest_rate == rate || rate->interval_us < fastest_rate->interval_us) {
+            fastest_rate = rate;
+        }
+        if (!settled && debug.enabled) {
+            printf("DEBUG: %s reports at about %.0f Hz", rate->name, 1e6 / rate->interval_us);
+            if (aggregate_auto) printf(", aggregating over %ld us", auto_aggregate_us());
+            printf("\n");
+        }
+        return;
+    }
+    if (ev->type != EV_REL) return;
+    if (ev->code != REL_X && ev->code != REL_Y) return;
+
+    int dx = (ev->code == REL_X) ? ev->value : 0;
+    int dy = (ev->code == REL_Y) ? ev->value : 0;
+
+    long window_us = aggregate_auto ? auto_aggregate_us() : aggregate_ms * 1000L;
+    if (atomic_load_explicit(&degrade_level, memory_order_relaxed) >= 3) {
+        window_us = window_us * 2 > DEGRADED_AGGREGATE_MS * 1000L ? window_us * 2 : DEGRADED_AGGREGATE_MS * 1000L;
+    }
+    if (window_us > 0) {
+        if (!aggregating) {
+            aggregating = true;
+            aggregate_start = time;
+        }
+        aggregate_dx += dx;
+        aggregate_dy += dy;
+        aggregate_source = source;
+        if (timespec_diff_us(&time, &aggregate_start) < window_us) return;
+
+        dx = aggregate_dx;
+        dy = aggregate_dy;
+        aggregate_dx = aggregate_dy = 0;
+        aggregating = false;
+        source = aggregate_source;
+    }
+
+    int new_intensity = calculate_intensity(dx, dy);
+    event_stream_push(&time, source, new_intensity, debug.last_raw_movement);
+    engine_trigger(new_intensity, &time);
+}
+
+// Frames are released to process_event() in timestamp order across
+// devices. Each device's own frames are in order, so the oldest buffered
+// frame is safe once every device has one buffered; otherwise it is held
+// until it is reorder_us old, for a device that has not been read yet.
+// The heap holds the devices with buffered frames, keyed by their oldest.
+static int merge_heap[MAX_INPUT_DEVICES];
+static int merge_heap_size = 0;
+static int merge_live_sources = 0;
+static unsigned long merge_sequence = 0;
+static unsigned long merge_released_sequence = 0;
+static struct timespec merge_released_time;
+
+static const struct input_frame *source_oldest(const struct input_source *src) {
+    return &src->frames[src->tail % SOURCE_FRAMES];
+}
+
+// Ties go to the frame read first, so the order is deterministic.
+static bool frame_before(const struct input_frame *a, const struct input_frame *b) {
+    if (a->time.tv_sec != b->time.tv_sec) return a->time.tv_sec < b->time.tv_sec;
+    if (a->time.tv_nsec != b->time.tv_nsec) return a->time.tv_nsec < b->time.tv_nsec;
+    return a->sequence < b->sequence;
+}
+
+static bool merge_less(int i, int j) {
+    return frame_before(source_oldest(&sources[merge_heap[i]]), source_oldest(&sources[merge_heap[j]]));
+}
+
+static void merge_swap(int i, int j) {
+    int t = merge_heap[i];
+    merge_heap[i] = merge_heap[j];
+    merge_heap[j] = t;
+}
+
+static void merge_sift_down(int i) {
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < merge_heap_size && merge_less(left, least)) least = left;
+        if (right < merge_heap_size && merge_less(right, least)) least = right;
+        if (least == i) return;
+        merge_swap(i, least);
+        i = least;
+    }
+}
+
+static void merge_push(int source) {
+    int i = merge_heap_size++;
+    merge_heap[i] = source;
+    while (i > 0 && merge_less(i, (i - 1) / 2)) {
+        merge_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// Hands the oldest buffered frame to process_event().
+static void merge_release(void) {
+    struct input_source *src = &sources[merge_heap[0]];
+    struct input_frame *frame = &src->frames[src->tail % SOURCE_FRAMES];
+
+    atomic_fetch_add(&engine.input_frames, 1);
+    if (merge_released_sequence > 0) {
+        if (frame->sequence < merge_released_sequence) {
+            atomic_fetch_add(&engine.input_frames_reordered, 1);
+        }
+        if (timespec_diff_us(&frame->time, &merge_released_time) < 0) {
+            atomic_fetch_add(&engine.input_frames_late, 1);
+        }
+    }
+    if (frame->sequence + 1 > merge_released_sequence) merge_released_sequence = frame->sequence + 1;
+    merge_released_time = frame->time;
+
+    for (int i = 0; i < frame->count; i++) {
+        process_event(&frame->events[i], merge_heap[0]);
+    }
+
+    src->tail++;
+    if (src->tail == src->head) merge_heap[0] = merge_heap[--merge_heap_size];
+    merge_sift_down(0);
+}
+
+// Releases what is safe or old enough and arms the timer for the next
+// frame that is being held.
+static void merge_flush(int timer_fd) {
+    struct itimerspec timer = {0};
+    while (merge_heap_size > 0) {
+        const struct input_source *src = &sources[merge_heap[0]];
+        if (merge_heap_size < merge_live_sources) {
+            struct timespec now;
+            clock_gettime(src->clock_id, &now);
+            long held_us = timespec_diff_us(&now, &source_oldest(src)->time);
+            if (held_us < reorder_us) {
+                long wait_us = reorder_us - held_us;
+                timer.it_value.tv_sec = wait_us / 1000000L;
+                timer.it_value.tv_nsec = (wait_us % 1000000L) * 1000L;
+                break;
+            }
+        }
+        merge_release();
+    }
+    timerfd_settime(timer_fd, 0, &timer, NULL);
+}
+
+// Files one event into the frame being built for its device. A frame
+// without a SYN_REPORT in FRAME_MAX_EVENTS is cut short. A device whose
+// buffer fills up forces the oldest frames out early.
+static void source_take(int index, const struct input_event *ev) {
+    struct input_source *src = &sources[index];
+    struct input_frame *frame = &src->frames[src->head % SOURCE_FRAMES];
+    frame->events[frame->count++] = *ev;
+    if (frame->count < FRAME_MAX_EVENTS && !(ev->type == EV_SYN && ev->code == SYN_REPORT)) return;
+
+    frame->time.tv_sec = ev->input_event_sec;
+    frame->time.tv_nsec = ev->input_event_usec * 1000L;
+    frame->sequence = merge_sequence++;
+    if (src->head++ == src->tail) merge_push(index);
+    while (src->head - src->tail == SOURCE_FRAMES) {
+        atomic_fetch_add(&engine.input_frames_forced, 1);
+        merge_release();
+    }
+    src->frames[src->head % SOURCE_FRAMES].count = 0;
+}
+
+// Everything queued is taken in one read. The newest event's stamp
+// against the time of the read is the reader's scheduling delay,
+// separate from anything the audio path adds.
+static bool source_read(int index) {
+    struct input_source *src = &sources[index];
+    struct input_event events[READ_BATCH];
+    ssize_t n = read(src->fd, events, sizeof(events));
+    atomic_fetch_add(&engine.reader_wakeups, 1);
+    if (n < (ssize_t)sizeof(struct input_event)) {
+        if (n < 0 && errno == EINTR) return true;
+        if (running) {
+            fprintf(stderr, "Error reading input event from %s: %s\n", src->path,
+                    n < 0 ? strerror(errno) : "end of input");
+        }
+        return false;
+    }
+
+    size_t count = (size_t)n / sizeof(struct input_event);
+    atomic_fetch_add(&engine.input_events, (long)count);
+    struct timespec now;
+    clock_gettime(src->clock_id, &now);
+    struct timespec newest = {
+        .tv_sec = events[count - 1].input_event_sec,
+        .tv_nsec = events[count - 1].input_event_usec * 1000L,
+    };
+    long delay_us = timespec_diff_us(&now, &newest);
+    latency_record(&reader_delay, delay_us);
+    if (delay_us > reader_delay_bound_us) {
+        atomic_fetch_add(&engine.reader_delays_over_bound, 1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        source_take(index, &events[i]);
+    }
+    return true;
+}
+
+void monitor_devices(void) {
+    for (int i = 0; i < source_count; i++) {
+        struct input_source *src = &sources[i];
+        src->fd = open(src->path, O_RDONLY | O_CLOEXEC);
+        if (src->fd < 0) {
+            fprintf(stderr, "Failed to open device %s: %s\n", src->path, strerror(errno));
+            while (i-- > 0) close(sources[i].fd);
+            return;
+        }
+        src->rate.name = src->path;
+
+        // Latency is measured against CLOCK_MONOTONIC; older kernels keep
+        // realtime stamps, which skews the latency statistics and, with
+        // several devices, the merge order of that device.
+        src->clock_id = CLOCK_MONOTONIC;
+        if (ioctl(src->fd, EVIOCSCLOCKID, &src->clock_id) < 0) {
+            src->clock_id = CLOCK_REALTIME;
+            if (debug.enabled) {
+                printf("DEBUG: Could not switch event clock of %s to monotonic: %s\n",
+                       src->path, strerror(errno));
+            }
+        }
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (epoll_fd < 0 || timer_fd < 0) {
+        perror("Failed to set up input polling");
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (timer_fd >= 0) close(timer_fd);
+        for (int i = 0; i < source_count; i++) close(sources[i].fd);
+        return;
+    }
+    struct epoll_event watch = { .events = EPOLLIN, .data.u32 = MAX_INPUT_DEVICES };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &watch);
+    watch.data.u32 = MAX_INPUT_DEVICES + 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &watch);
+    for (int i = 0; i < source_count; i++) {
+        watch.data.u32 = (uint32_t)i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sources[i].fd, &watch);
+    }
+    merge_live_sources = source_count;
+
+    if (engine_start()) {
+        for (int i = 0; i < source_count; i++) {
+            startup_mark("Reading input from %s", sources[i].path);
+        }
+
+        while (running && merge_live_sources > 0) {
+            struct epoll_event ready[MAX_INPUT_DEVICES + 2];
+            int n = epoll_wait(epoll_fd, ready, MAX_INPUT_DEVICES + 2, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("Error waiting for input");
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                uint32_t index = ready[i].data.u32;
+                if (index == MAX_INPUT_DEVICES + 1) {
+                    break;
+                } else if (index == MAX_INPUT_DEVICES) {
+                    uint64_t expirations;
+                    while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    }
+                } else if (sources[index].fd >= 0 && !source_read((int)index)) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sources[index].fd, NULL);
+                    close(sources[index].fd);
+                    sources[index].fd = -1;
+                    merge_live_sources--;
+                }
+            }
+            merge_flush(timer_fd);
+        }
+        if (!running) printf("\nReceived SIGINT, shutting down...\n");
+        engine_stop();
+        print_debug_stats();
+    }
+
+    for (int i = 0; i < source_count; i++) {
+        if (sources[i].fd >= 0) close(sources[i].fd);
+    }
+    close(timer_fd);
+    close(epoll_fd);
+}
+
+bool sample_process(struct process_sample *sample) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return false;
+    long size_pages, resident_pages;
+    int fields = fscanf(f, "%ld %ld", &size_pages, &resident_pages);
+    fclose(f);
+    if (fields != 2) return false;
+    sample->rss_kb = resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) return false;
+    sample->open_fds = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') sample->open_fds++;
+    }
+    closedir(dir);
+    sample->open_fds--;  // the directory stream itself
+
+    f = fopen("/proc/self/status", "r");
+    if (!f) return false;
+    char line[256];
+    sample->threads = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Threads: %d", &sample->threads) == 1) break;
+    }
+    fclose(f);
+
+    // Every context switch of every thread is a wakeup of this process.
+    sample->context_switches = 0;
+    dir = opendir("/proc/self/task");
+    if (!dir) return false;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char path[DEVICE_PATH_MAX];
+        snprintf(path, sizeof(path), "/proc/self/task/%s/status", entry->d_name);
+        f = fopen(path, "r");
+        if (!f) continue;
+        long switches;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "voluntary_ctxt_switches: %ld", &switches) == 1 ||
+                sscanf(line, "nonvoluntary_ctxt_switches: %ld", &switches) == 1) {
+                sample->context_switches += switches;
+            }
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    return sample->threads > 0;
+}
+
+struct soak_load {
+    const char *capture_path;
+    struct input_event *capture;
+    size_t capture_len;
+};
+
+static volatile bool soak_running = true;
+
+static void soak_sleep_until(struct timespec *deadline, long delta_ns) {
+    deadline->tv_nsec += delta_ns;
+    while (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_nsec -= 1000000000L;
+        deadline->tv_sec++;
+    }
+    // SIGINT may land on a backend thread, so wait on shutdown_fd too.
+    struct pollfd wake = { .fd = shutdown_fd, .events = POLLIN };
+    while (running) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_us = timespec_diff_us(deadline, &now);
+        if (remaining_us <= 0) break;
+        struct timespec timeout = {
+            .tv_sec = remaining_us / 1000000,
+            .tv_nsec = remaining_us % 1000000 * 1000,
+        };
+        ppoll(&wake, 1, &timeout, NULL);
+    }
+}
+
+// Feeds the normal event path, either by looping over a raw evdev capture
+// (as produced by `cat /dev/input/eventN > file`) with its original
+// spacing, or with a synthetic random walk covering every intensity level.
+static void *soak_load_thread(void *arg) {
+    struct soak_load *load = arg;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    unsigned int seed = (unsigned int)deadline.tv_nsec;
+    long synthetic_gap_ns = (long)(1e9 / soak.event_rate);
+    double log_span = log(max_movement_threshold * 2.0);
+    size_t index = 0;
+
+    while (soak_running && running) {
+        struct input_event ev;
+        long gap_ns;
+
+        if (load->capture) {
+            ev = load->capture[index];
+            size_t next = (index + 1) % load->capture_len;
+            const struct input_event *a = &load->capture[index];
+            const struct input_event *b = &load->capture[next];
+            gap_ns = ((long)(b->input_event_sec - a->input_event_sec) * 1000000L +
+                      (long)(b->input_event_usec - a->input_event_usec)) * 1000L;
+            if (gap_ns < 0 || gap_ns > 1000000000L) gap_ns = 0;
+            index = next;
+        } else {
+            memset(&ev, 0, sizeof(ev));
+            ev.type = EV_REL;
+            ev.code = (index++ & 1) ? REL_Y : REL_X;
+            double magnitude = exp(((double)rand_r(&seed) / RAND_MAX) * log_span);
+            ev.value = (int)magnitude * ((rand_r(&seed) & 1) ? 1 : -1);
+            gap_ns = synthetic_gap_ns;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ev.input_event_sec = now.tv_sec;
+        ev.input_event_usec = now.tv_nsec / 1000;
+        atomic_fetch_add(&engine.input_events, 1);
+        process_event(&ev, 0);
+
+        if (gap_ns > 0) soak_sleep_until(&deadline, gap_ns);
+    }
+    return NULL;
+}
+
+static bool soak_load_capture(struct soak_load *load) {
+    int fd = open(load->capture_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open capture '%s': %s\n", load->capture_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: Capture '%s' must be a regular file of input events\n", load->capture_path);
+        close(fd);
+        return false;
+    }
+
+    load->capture_len = (size_t)st.st_size / sizeof(struct input_event);
+    if (load->capture_len == 0) {
+        fprintf(stderr, "Error: Capture '%s' contains no input events\n", load->capture_path);
+        close(fd);
+        return false;
+    }
+
+    load->capture = malloc(load->capture_len * sizeof(struct input_event));
+    size_t bytes = load->capture_len * sizeof(struct input_event);
+    ssize_t n = load->capture ? read(fd, load->capture, bytes) : -1;
+    close(fd);
+    if (n != (ssize_t)bytes) {
+        fprintf(stderr, "Error: Failed to read capture '%s'\n", load->capture_path);
+        free(load->capture);
+        load->capture = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Runs the normal trigger and playback path under synthetic or replayed
+// load for soak.duration seconds, sampling process resources and latency
+// every soak.interval seconds. The first sample is the baseline; any later
+// sample drifting past the configured limits fails the run.
+int run_soak(const char *capture_path) {
+    struct soak_load load = { .capture_path = capture_path };
+    if (capture_path && !soak_load_capture(&load)) {
+        return 1;
+    }
+
+    printf("Soak: %s for %.0f s, sampling every %.0f s\n",
+           capture_path ? capture_path : "synthetic load", soak.duration, soak.interval);
+    source_count = 1;
+    sources[0].rate.name = capture_path ? capture_path : "synthetic load";
+
+    if (!engine_start()) {
+        free(load.capture);
+        return 1;
+    }
+
+    // The load thread stands in for the reader; SIGINT is left to the
+    // main thread, which ends the run.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_t load_thread;
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    int err = pthread_create(&load_thread, NULL, soak_load_thread, &load);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to create soak load thread");
+        engine_stop();
+        free(load.capture);
+        return 1;
+    }
+
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+
+    struct process_sample baseline = {0};
+    struct process_sample previous = {0};
+    sample_process(&previous);
+    struct latency_histogram previous_latency;
+    latency_snapshot(&previous_latency, &trigger_latency);
+    long baseline_p99 = 0;
+    bool have_baseline = false;
+    int failures = 0;
+    long interval_ns = (long)(soak.interval * 1e9);
+
+    while (running && failures == 0) {
+        soak_sleep_until(&deadline, interval_ns);
+        if (!running) {
+            printf("\nReceived SIGINT, shutting down...\n");
+            break;
+        }
+
+        struct process_sample sample;
+        if (!sample_process(&sample)) {
+            fprintf(stderr, "Error: Failed to sample /proc/self\n");
+            failures++;
+            break;
+        }
+
+        struct latency_histogram latency;
+        latency_snapshot(&latency, &trigger_latency);
+        struct latency_histogram window = latency;
+        latency_window(&window, &previous_latency);
+        previous_latency = latency;
+        long p50 = latency_percentile(&window, 50.0);
+        long p99 = latency_percentile(&window, 99.0);
+        long window_triggers = window.count;
+
+        int voices_now = atomic_load(&engine.active_voices);
+        int voices_peak = atomic_exchange(&engine.peak_voices, voices_now);
+        double wakeups = (sample.context_switches - previous.context_switches) / soak.interval;
+        previous = sample;
+
+        double elapsed = timespec_diff_us(&deadline, &start) / 1e6;
+        printf("Soak: t=%6.0fs rss=%ldKB fds=%d threads=%d voices=%d/%d/%d wakeups=%.0f/s "
+               "triggers=%ld p50=%ldus p99=%ldus\n",
+               elapsed, sample.rss_kb, sample.open_fds, sample.threads,
+               voices_now, voices_peak, max_voices, wakeups, window_triggers, p50, p99);
+        fflush(stdout);
+
+        if (!have_baseline) {
+            baseline = sample;
+            baseline_p99 = p99;
+            have_baseline = true;
+        } else {
+            if (sample.rss_kb - baseline.rss_kb > soak.max_rss_growth_kb) {
+                fprintf(stderr, "Soak FAILED: RSS grew %ld KB over baseline (limit %ld KB)\n",
+                        sample.rss_kb - baseline.rss_kb, soak.max_rss_growth_kb);
+                failures++;
+            }
+            if (sample.open_fds - baseline.open_fds > soak.max_fd_growth) {
+                fprintf(stderr, "Soak FAILED: open fds grew from %d to %d (limit +%d)\n",
+                        baseline.open_fds, sample.open_fds, soak.max_fd_growth);
+                failures++;
+            }
+            if (sample.threads - baseline.threads > soak.max_thread_growth) {
+                fprintf(stderr, "Soak FAILED: threads grew from %d to %d (limit +%d)\n",
+                        baseline.threads, sample.threads, soak.max_thread_growth);
+                failures++;
+            }
+            // Triggers start on period boundaries, so allow one period of
+            // quantization on top of the ratio.
+            long period_us = period_frames * 1000000L / sample_rate;
+            if (baseline_p99 > 0 && window_triggers > 0 &&
+                p99 > baseline_p99 * soak.max_latency_drift + period_us) {
+                fprintf(stderr, "Soak FAILED: p99 latency %ld us exceeds %.1fx baseline %ld us + one period\n",
+                        p99, soak.max_latency_drift, baseline_p99);
+                failures++;
+            }
+            if (baseline_p99 == 0) baseline_p99 = p99;
+        }
+
+        if (elapsed >= soak.duration) break;
+    }
+
+    soak_running = false;
+    pthread_join(load_thread, NULL);
+    engine_stop();
+    free(load.capture);
+
+    print_debug_stats();
+    printf("Soak %s\n", failures == 0 ? "PASSED" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
+
+#define BENCHMARK_FRAMES 1024
+#define BENCHMARK_NS 50000000L
+
+// Times one kernel over BENCHMARK_FRAMES-frame calls for about
+// BENCHMARK_NS and returns nanoseconds per frame.
+static double benchmark_kernel(const struct mix_kernels *k, int op) {
+    static float a[BENCHMARK_FRAMES], b[BENCHMARK_FRAMES], src[BENCHMARK_FRAMES];
+    static int16_t out[BENCHMARK_FRAMES * ENGINE_CHANNELS];
+    for (int i = 0; i < BENCHMARK_FRAMES; i++) {
+        src[i] = sinf(i * 0.01f) * 0.5f;
+        a[i] = b[i] = 0.0f;
+    }
+
+    struct timespec begin, now;
+    long calls = 0;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    do {
+        for (int i = 0; i < 64; i++) {
+            switch (op) {
+                case 0: k->gain(a, src, BENCHMARK_FRAMES, 0.5f); break;
+                case 1: k->mix(a, src, BENCHMARK_FRAMES, 1e-3f); break;
+                case 2: k->pan(a, b, src, BENCHMARK_FRAMES, 1e-3f, 1e-3f); break;
+                default: k->to_s16(out, src, a, BENCHMARK_FRAMES); break;
+            }
+        }
+        calls += 64;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (timespec_diff_us(&now, &begin) * 1000L < BENCHMARK_NS);
+
+    return timespec_diff_us(&now, &begin) * 1000.0 / ((double)calls * BENCHMARK_FRAMES);
+}
+
+enum benchmark_voice_kind {
+    BENCHMARK_PLAIN,
+    BENCHMARK_FILTERED,
+    BENCHMARK_SYNTH,
+};
+
+// Times a period of `voices` voices, plain, filtered or synthesized,
+// playing levels spread over the bank (filtered ones from a single
+// level-10 source), and returns nanoseconds per voice-frame.
+static double benchmark_voices(enum benchmark_voice_kind kind, int voices) {
+    static float plane[BENCHMARK_FRAMES * 4];
+    static int16_t out[BENCHMARK_FRAMES * ENGINE_CHANNELS];
+    struct sample_clip clip = {
+        .planes = { plane, plane }, .channels = 1, .rate = sample_rate, .length = BENCHMARK_FRAMES * 4,
+    };
+    for (size_t i = 0; i < clip.length; i++) plane[i] = sinf(i * 0.01f) * 0.5f;
+    for (int level = 1; level <= NUM_INTENSITY_LEVELS; level++) clip_source[level] = NUM_INTENSITY_LEVELS;
+    const char *saved_filter = filter_render;
+    bool saved_synth = synth_render;
+    filter_render = kind == BENCHMARK_FILTERED ? "10" : NULL;
+    synth_render = kind == BENCHMARK_SYNTH;
+
+    struct timespec begin, now;
+    long calls = 0;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    do {
+        pool.active_count = voices;
+        for (int v = 0; v < voices; v++) {
+            pool.active[v] = (uint8_t)v;
+            pool.clip[v] = &clip;
+            pool.position[v] = 0;
+            pool.increment[v] = VOICE_UNITY;
+            pool.gain[v] = 0.1f;
+            pool.offset[v] = 0;
+            if (kind == BENCHMARK_FILTERED) filter_voice_setup(v, 1 + v % NUM_INTENSITY_LEVELS);
+            if (kind == BENCHMARK_SYNTH) synth_voice_setup(v, 1 + v % NUM_INTENSITY_LEVELS);
+        }
+        mix_period(out, BENCHMARK_FRAMES);
+        calls++;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (timespec_diff_us(&now, &begin) * 1000L < BENCHMARK_NS);
+
+    filter_render = saved_filter;
+    synth_render = saved_synth;
+    return timespec_diff_us(&now, &begin) * 1000.0 / ((double)calls * voices * BENCHMARK_FRAMES);
+}
+
+// Prints ns per frame for every kernel set this CPU supports, plus the
+// speedup of each over the scalar set.
+int run_benchmark(void) {
+    static const char *ops[] = { "gain", "mix", "pan", "to_s16" };
+    const struct mix_kernels *scalar = &mix_kernel_sets[NUM_MIX_KERNEL_SETS - 1];
+    double reference[4];
+    for (int op = 0; op < 4; op++) {
+        reference[op] = benchmark_kernel(scalar, op);
+    }
+
+    printf("Mix kernels, ns per frame over %d-frame calls (speedup over scalar):\n", BENCHMARK_FRAMES);
+    printf("  %-8s", "set");
+    for (int op = 0; op < 4; op++) printf("  %-14s", ops[op]);
+    printf("\n");
+    for (size_t i = 0; i < NUM_MIX_KERNEL_SETS; i++) {
+        const struct mix_kernels *k = &mix_kernel_sets[i];
+        if (!k->supported()) {
+            printf("  %-8s  not supported on this CPU\n", k->name);
+            continue;
+        }
+        printf("  %-8s", k->name);
+        for (int op = 0; op < 4; op++) {
+            double ns = k == scalar ? reference[op] : benchmark_kernel(k, op);
+            printf("  %6.3f (%4.1fx)", ns, reference[op] / ns);
+        }
+        printf("\n");
+    }
+    printf("Selected at startup: %s\n", select_mix_kernels()->name);
+
+    kernels = select_mix_kernels();
+    static const int voice_counts[] = { 1, 4, 8, MAX_VOICES };
+    printf("Voices, ns per voice-frame over %d-frame periods (plain clip / filtered / synthesized):\n",
+           BENCHMARK_FRAMES);
+    for (size_t i = 0; i < sizeof(voice_counts) / sizeof(voice_counts[0]); i++) {
+        int voices = voice_counts[i];
+        double plain = benchmark_voices(BENCHMARK_PLAIN, voices);
+        double filtered = benchmark_voices(BENCHMARK_FILTERED, voices);
+        double synthesized = benchmark_voices(BENCHMARK_SYNTH, voices);
+        printf("  %2d voice(s)  %6.3f / %6.3f / %6.3f  (synthesized: %.0fx real time at %d Hz)\n", voices,
+               plain, filtered, synthesized, 1e9 / (synthesized * voices * sample_rate), sample_rate);
+    }
+    return 0;
+}
+
+enum long_only_option {
+    OPT_SOAK = 256,
+    OPT_SOAK_INTERVAL,
+    OPT_SOAK_RATE,
+    OPT_SOAK_MAX_RSS,
+    OPT_SOAK_MAX_FDS,
+    OPT_SOAK_MAX_THREADS,
+    OPT_SOAK_MAX_DRIFT,
+    OPT_RATE,
+    OPT_PERIOD_FRAMES,
+    OPT_BUFFER_FRAMES,
+    OPT_VOICES,
+    OPT_IDLE_TIMEOUT,
+    OPT_ADAPTIVE_LATENCY,
+    OPT_LOCK_BANK,
+    OPT_HUGE_PAGES,
+    OPT_LAZY_BANK,
+    OPT_BENCHMARK,
+    OPT_HEADROOM_WARN,
+    OPT_AGGREGATE_MS,
+    OPT_FILTER_RENDER,
+    OPT_SYNTH,
+    OPT_PACK_BANK,
+    OPT_READER_DELAY_BOUND,
+    OPT_TIMESERIES,
+    OPT_STATS_FILE,
+    OPT_PROBE_RATE,
+    OPT_REORDER_US,
+    OPT_TEE,
+    OPT_SHM_CONSUME,
+    OPT_EVENTS,
+};
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"list-devices", no_argument, 0, 'l'},
+        {"input", required_argument, 0, 'i'},
+        {"debug", no_argument, 0, 'd'},
+        {"help", no_argument, 0, 'h'},
+        {"version", no_argument, 0, 'v'},
+        {"min-threshold", required_argument, 0, 'm'},
+        {"max-threshold", required_argument, 0, 'M'},
+        {"log-base", required_argument, 0, 'b'},
+        {"no-sound", no_argument, 0, 'n'},
+        {"sound-dir", required_argument, 0, 's'},
+        {"backend", required_argument, 0, 'o'},
+        {"audio-device", required_argument, 0, 'D'},
+        {"rate", required_argument, 0, OPT_RATE},
+        {"period-frames", required_argument, 0, OPT_PERIOD_FRAMES},
+        {"buffer-frames", required_argument, 0, OPT_BUFFER_FRAMES},
+        {"voices", required_argument, 0, OPT_VOICES},
+        {"idle-timeout", required_argument, 0, OPT_IDLE_TIMEOUT},
+        {"headroom-warn", required_argument, 0, OPT_HEADROOM_WARN},
+        {"aggregate-ms", required_argument, 0, OPT_AGGREGATE_MS},
+        {"adaptive-latency", no_argument, 0, OPT_ADAPTIVE_LATENCY},
+        {"lock-bank", no_argument, 0, OPT_LOCK_BANK},
+        {"huge-pages", required_argument, 0, OPT_HUGE_PAGES},
+        {"lazy-bank", no_argument, 0, OPT_LAZY_BANK},
+        {"filter-render", required_argument, 0, OPT_FILTER_RENDER},
+        {"synth", no_argument, 0, OPT_SYNTH},
+        {"pack-bank", required_argument, 0, OPT_PACK_BANK},
+        {"reader-delay-bound", required_argument, 0, OPT_READER_DELAY_BOUND},
+        {"timeseries", required_argument, 0, OPT_TIMESERIES},
+        {"stats-file", required_argument, 0, OPT_STATS_FILE},
+        {"probe-rate", required_argument, 0, OPT_PROBE_RATE},
+        {"reorder-us", required_argument, 0, OPT_REORDER_US},
+        {"tee", required_argument, 0, OPT_TEE},
+        {"shm-consume", required_argument, 0, OPT_SHM_CONSUME},
+        {"events", required_argument, 0, OPT_EVENTS},
+        {"benchmark", no_argument, 0, OPT_BENCHMARK},
+        {"soak", required_argument, 0, OPT_SOAK},
+        {"soak-interval", required_argument, 0, OPT_SOAK_INTERVAL},
+        {"soak-rate", required_argument, 0, OPT_SOAK_RATE},
+        {"soak-max-rss", required_argument, 0, OPT_SOAK_MAX_RSS},
+        {"soak-max-fds", required_argument, 0, OPT_SOAK_MAX_FDS},
+        {"soak-max-threads", required_argument, 0, OPT_SOAK_MAX_THREADS},
+        {"soak-max-drift", required_argument, 0, OPT_SOAK_MAX_DRIFT},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    bool list_requested = false;
+    bool benchmark_requested = false;
+    const char *pack_path = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &startup_time);
+
+    while ((opt = getopt_long(argc, argv, "li:dhvm:M:b:ns:o:D:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                list_requested = true;
+                break;
+            case 'i':
+                if (source_count == MAX_INPUT_DEVICES) {
+                    fprintf(stderr, "Error: At most %d input devices can be given\n", MAX_INPUT_DEVICES);
+                    return 1;
+                }
+                sources[source_count++].path = optarg;
                 break;
             case 'd':
                 debug.enabled = true;
-                printf("Debug mode enabled\n");
                 break;
             case 'h':
                 print_usage(argv[0]);
@@ -392,24 +6445,172 @@ int main(int argc, char *argv[]) {
             case 's':
                 sound_directory = optarg;
                 break;
+            case 'o':
+                backend_name = optarg;
+                break;
+            case 'D':
+                audio_device = optarg;
+                break;
+            case OPT_RATE:
+                sample_rate = atoi(optarg);
+                break;
+            case OPT_PERIOD_FRAMES:
+                period_frames = atoi(optarg);
+                break;
+            case OPT_BUFFER_FRAMES:
+                buffer_frames = atoi(optarg);
+                break;
+            case OPT_VOICES:
+                max_voices = atoi(optarg);
+                break;
+            case OPT_IDLE_TIMEOUT:
+                idle_timeout_ms = atol(optarg);
+                break;
+            case OPT_HEADROOM_WARN:
+                headroom_warn_pct = atof(optarg);
+                break;
+            case OPT_READER_DELAY_BOUND:
+                reader_delay_bound_us = atol(optarg);
+                break;
+            case OPT_TIMESERIES:
+                series_path = optarg;
+                break;
+            case OPT_STATS_FILE:
+                stats_path = optarg;
+                break;
+            case OPT_AGGREGATE_MS:
+                if (strcmp(optarg, "auto") == 0) {
+                    aggregate_auto = true;
+                } else {
+                    aggregate_ms = atol(optarg);
+                }
+                break;
+            case OPT_PROBE_RATE:
+                probe_rate_ms = atol(optarg);
+                break;
+            case OPT_REORDER_US:
+                reorder_us = atol(optarg);
+                break;
+            case OPT_SHM_CONSUME:
+                shm_consume_path = optarg;
+                break;
+            case OPT_EVENTS:
+                event_path = optarg;
+                break;
+            case OPT_TEE:
+                if (!add_sink(optarg)) {
+                    fprintf(stderr, "Error: Invalid output '%s' (wav:FILE, alsa:DEVICE or shm:SOCKET, at most %d)\n",
+                            optarg, MAX_SINKS);
+                    return 1;
+                }
+                break;
+            case OPT_ADAPTIVE_LATENCY:
+                adaptive_latency = true;
+                break;
+            case OPT_LOCK_BANK:
+                lock_bank = true;
+                break;
+            case OPT_HUGE_PAGES:
+                huge_pages = optarg;
+                break;
+            case OPT_LAZY_BANK:
+                lazy_bank = true;
+                break;
+            case OPT_FILTER_RENDER:
+                filter_render = optarg;
+                break;
+            case OPT_SYNTH:
+                synth_render = true;
+                break;
+            case OPT_PACK_BANK:
+                pack_path = optarg;
+                break;
+            case OPT_BENCHMARK:
+                benchmark_requested = true;
+                break;
+            case OPT_SOAK:
+                soak.duration = atof(optarg);
+                break;
+            case OPT_SOAK_INTERVAL:
+                soak.interval = atof(optarg);
+                break;
+            case OPT_SOAK_RATE:
+                soak.event_rate = atof(optarg);
+                break;
+            case OPT_SOAK_MAX_RSS:
+                soak.max_rss_growth_kb = atol(optarg);
+                break;
+            case OPT_SOAK_MAX_FDS:
+                soak.max_fd_growth = atoi(optarg);
+                break;
+            case OPT_SOAK_MAX_THREADS:
+                soak.max_thread_growth = atoi(optarg);
+                break;
+            case OPT_SOAK_MAX_DRIFT:
+                soak.max_latency_drift = atof(optarg);
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
         }
     }
 
+    // With --events - stdout carries the records; what would otherwise be
+    // printed there goes to stderr from here on, including anything still
+    // buffered.
+    if (event_path && strcmp(event_path, "-") == 0) {
+        event_stream.fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    // A --shm-consume consumer's stdout carries audio only.
+    if (debug.enabled && !shm_consume_path) {
+        printf("Debug mode enabled\n");
+    }
+
+    if (probe_rate_ms < 0) {
+        fprintf(stderr, "Error: Probe time cannot be negative\n");
+        return 1;
+    }
+
     if (list_requested) {
         list_input_devices();
         return 0;
     }
 
-    if (device_path == NULL) {
+    if (pack_path) {
+        return pack_sound_bank(sound_directory, pack_path);
+    }
+
+    if (shm_consume_path) {
+        signal(SIGPIPE, SIG_IGN);
+        return shm_consume(shm_consume_path);
+    }
+
+    if (source_count == 0 && soak.duration <= 0 && !benchmark_requested) {
         fprintf(stderr, "Error: Input device is required\n");
         print_usage(argv[0]);
         return 1;
     }
+    if (source_count > 1 && soak.duration > 0) {
+        fprintf(stderr, "Error: The soak harness replays a single capture\n");
+        return 1;
+    }
+    if (reorder_us < 0 || reorder_us > MAX_REORDER_US) {
+        fprintf(stderr, "Error: Reorder delay must be between 0 and %d us\n", MAX_REORDER_US);
+        return 1;
+    }
 
-    if (!no_sound && !validate_sound_directory(sound_directory)) {
+    if (!map_clip_sources()) {
+        fprintf(stderr, "Error: Filter render levels must be a comma-separated list of 1-%d\n",
+                NUM_INTENSITY_LEVELS);
+        return 1;
+    }
+    if (synth_render && (filter_render || lazy_bank)) {
+        fprintf(stderr, "Error: --synth cannot be combined with --filter-render or --lazy-bank\n");
+        return 1;
+    }
+    if (!no_sound && !synth_render && !benchmark_requested && !validate_sound_directory(sound_directory)) {
         return 1;
     }
 
@@ -425,19 +6626,96 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: Log base must be greater than 1\n");
         return 1;
     }
+    if (!find_backend(backend_name)) {
+        fprintf(stderr, "Error: Unknown audio backend '%s'\n", backend_name);
+        return 1;
+    }
+    if (sample_rate < 8000 || sample_rate > 192000) {
+        fprintf(stderr, "Error: Sample rate must be between 8000 and 192000\n");
+        return 1;
+    }
+    if (period_frames < 16 || period_frames > MAX_PERIOD_FRAMES) {
+        fprintf(stderr, "Error: Period must be between 16 and %d frames\n", MAX_PERIOD_FRAMES);
+        return 1;
+    }
+    if (buffer_frames < 2 * period_frames) {
+        fprintf(stderr, "Error: Buffer must hold at least two periods\n");
+        return 1;
+    }
+    if (strcmp(huge_pages, "off") != 0 && strcmp(huge_pages, "thp") != 0 &&
+        strcmp(huge_pages, "explicit") != 0) {
+        fprintf(stderr, "Error: Huge pages mode must be off, thp or explicit\n");
+        return 1;
+    }
+    if (max_voices < 1 || max_voices > MAX_VOICES) {
+        fprintf(stderr, "Error: Voices must be between 1 and %d\n", MAX_VOICES);
+        return 1;
+    }
+    if (idle_timeout_ms < 0) {
+        fprintf(stderr, "Error: Idle timeout cannot be negative\n");
+        return 1;
+    }
+    if (aggregate_ms < 0) {
+        fprintf(stderr, "Error: Aggregation window cannot be negative\n");
+        return 1;
+    }
+    if (headroom_warn_pct < 0 || headroom_warn_pct > 100) {
+        fprintf(stderr, "Error: Headroom warning threshold must be between 0 and 100\n");
+        return 1;
+    }
+    if (reader_delay_bound_us <= 0) {
+        fprintf(stderr, "Error: Reader delay bound must be positive\n");
+        return 1;
+    }
+    if (soak.duration > 0 && (soak.interval <= 0 || soak.event_rate <= 0 || soak.max_latency_drift < 1.0)) {
+        fprintf(stderr, "Error: Soak interval and rate must be positive and drift at least 1.0\n");
+        return 1;
+    }
+
+    if (benchmark_requested) {
+        return run_benchmark();
+    }
+
+    if (stats_path && !stats_file_open()) {
+        return 1;
+    }
+    if (event_path && !event_stream_open()) {
+        return 1;
+    }
 
+    shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shutdown_fd < 0) {
+        perror("Failed to create shutdown eventfd");
+        return 1;
+    }
     signal(SIGINT, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
 
-    printf("Using input device: %s\n", device_path);
+    if (soak.duration > 0) {
+        return run_soak(source_count > 0 ? sources[0].path : NULL);
+    }
+
+    for (int i = 0; i < source_count; i++) {
+        printf("Using input device: %s\n", sources[i].path);
+    }
     printf("Configuration:\n");
-    printf("  Sound directory: %s\n", sound_directory);
+    if (synth_render) {
+        printf("  Sound: synthesized\n");
+    } else {
+        printf("  Sound directory: %s\n", sound_directory);
+    }
     printf("  Minimum threshold: %.2f\n", min_movement_threshold);
     printf("  Maximum threshold: %.2f\n", max_movement_threshold);
     printf("  Log base: %.2f\n", log_base);
     if (no_sound) {
         printf("  Sound: Disabled\n");
+    } else {
+        printf("  Output: %s, %d Hz, period %d, buffer %d frames%s, %d voice(s)\n",
+               backend_name, sample_rate, period_frames, buffer_frames,
+               adaptive_latency ? " (adaptive)" : "", max_voices);
     }
+    printf("  Idle timeout: %ld ms\n", idle_timeout_ms);
     
-    monitor_device(device_path);
+    monitor_devices();
     return 0;
 }
\ No newline at end of file